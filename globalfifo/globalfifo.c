@@ -84,7 +84,7 @@ static ssize_t globalfifo_read(struct file *filp, char __user *buf, size_t size,
 	goto out;
     } else {
 	memcpy(dev->mem, dev->mem+count, dev->current_len - count);  // fifo数据前移
-	dev->current_len -= count;  // 有效数据长度减少
+	WRITE_ONCE(dev->current_len, dev->current_len - count);  // 有效数据长度减少，poll不加锁读它
         printk(KERN_INFO "read %d bytes(s), current_len:%d\n", count, dev->current_len);
 	
 	wake_up_interruptible(&dev->w_wait); 	// 唤醒写等待队列
@@ -134,7 +134,7 @@ static ssize_t globalfifo_write(struct file *filp, const char __user *buf, size_
         ret = -EFAULT;
 	goto out;
     } else {
-	    dev->current_len += count;
+	    WRITE_ONCE(dev->current_len, dev->current_len + count);  // poll不加锁读它
         printk(KERN_INFO "writen %d bytes(s), current_len:%d\n", count, dev->current_len);
 
 	    wake_up_interruptible(&dev->r_wait);  // 唤醒读等待队列
@@ -210,20 +210,26 @@ long globalfifo_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
 static unsigned int globalfifo_poll(struct file *filp, poll_table *wait)
 {
-    unsigned int mask = 0;
+    unsigned int mask = 0, len;
     struct globalfifo_dev *dev = filp->private_data;    // 获取设备结构体指针
-    down(&dev->sem);
 
+    /*
+     * 不获取信号量：current_len只由持有信号量的读写者改写，poll只读一次。
+     * poll_wait先把我们挂到等待队列上，之后的改动都会唤醒我们，
+     * 所以读到旧值也不会丢失事件。
+     * No semaphore: poll_wait() queues us before we look, so a change
+     * made after the look wakes us up anyway.
+     */
     poll_wait(filp, &dev->r_wait, wait);
     poll_wait(filp, &dev->w_wait, wait);
+    len = READ_ONCE(dev->current_len);
     /*fifo非空*/
-    if (dev->current_len !=0)
+    if (len != 0)
         mask |= POLLIN | POLLRDNORM;    /*标示数据可获得*/
     /*fifo非满*/
-    if (dev->current_len != GLOBALFIFO_SIZE)
+    if (len != GLOBALFIFO_SIZE)
         mask |= POLLOUT | POLLWRNORM;   /*标示数据可写入*/
 
-    up(&dev->sem);
     return mask;
 }
 
@@ -0,0 +1,316 @@
+/*
+ * compact.c -- background compaction of the quantum lists
+ *
+ * Random writes, trims of the ring and quanta moved away by
+ * SCULL_IOCCOPY leave a device with holes: pointer arrays with few or
+ * no quanta in them, and empty qsets at the end of the list. The
+ * compactor runs from a workqueue, moves runs of whole quanta into
+ * extents (one contiguous block instead of many small kmallocs) and
+ * frees the pointer arrays and qsets left empty. It does its work in
+ * small steps and drops the device mutex between them, so readers and
+ * writers are only held up for one step at a time.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>	/* printk(), min() */
+#include <linux/slab.h>		/* kmalloc() */
+#include <linux/fs.h>		/* everything... */
+#include <linux/errno.h>	/* error codes */
+#include <linux/types.h>	/* size_t */
+#include <linux/cdev.h>
+#include <linux/sched.h>
+#include <linux/workqueue.h>
+
+#include "scull.h"		/* local definitions */
+
+/*
+ * Runs shorter than SCULL_COMPACT_MIN quanta are left alone; a step
+ * moves at most SCULL_COMPACT_MAX quanta, or looks at most at
+ * SCULL_COMPACT_SCAN slots, before it gives the mutex back.
+ */
+#define SCULL_COMPACT_MIN   4
+#define SCULL_COMPACT_MAX   64
+#define SCULL_COMPACT_SCAN  1024
+
+extern struct scull_dev *scull_devices;
+extern int scull_nr_devs;
+
+static void scull_compact_tick(struct work_struct *work);
+static DECLARE_DELAYED_WORK(scull_compact_timer, scull_compact_tick);
+
+/*
+ * Compact all devices every so many seconds; 0 means only on demand.
+ * A change at run time takes effect at once: the timer is moved, or
+ * stopped. Until scull_compact_start() there are no devices to
+ * compact, and after scull_compact_stop() none any more.
+ */
+static int scull_compact_secs = 0;
+static int scull_compact_running;
+static DEFINE_MUTEX(scull_compact_lock);
+
+static int scull_compact_secs_set(const char *val, const struct kernel_param *kp)
+{
+    int err = param_set_int(val, kp);
+
+    if (err)
+        return err;
+    mutex_lock(&scull_compact_lock);
+    if (scull_compact_running) {
+        if (scull_compact_secs > 0)
+            mod_delayed_work(system_wq, &scull_compact_timer, scull_compact_secs * HZ);
+        else
+            cancel_delayed_work(&scull_compact_timer);
+    }
+    mutex_unlock(&scull_compact_lock);
+    return 0;
+}
+
+static const struct kernel_param_ops scull_compact_secs_ops = {
+    .set = scull_compact_secs_set,
+    .get = param_get_int,
+};
+module_param_cb(scull_compact_secs, &scull_compact_secs_ops, &scull_compact_secs,
+                S_IRUGO | S_IWUSR);
+
+/*
+ * Fill in the fragmentation metrics; called with the device mutex held.
+ * Slack is memory held by the device that holds no data: the end of the
+ * last quantum, quanta hidden behind an extent and extent space beyond
+ * the end of the device.
+ */
+void scull_frag(struct scull_dev *dev, struct scull_frag *fr)
+{
+    struct scull_qset *dptr;
+    unsigned long slots = 0;
+    loff_t pos, itemsize = (loff_t) dev->quantum * dev->qset;
+    size_t len;
+    int item, i;
+
+    memset(fr, 0, sizeof(*fr));
+    for (dptr = dev->data, item = 0; dptr; dptr = dptr->next, item++) {
+        int used = 0;
+
+        fr->qsets++;
+        if (!dptr->data) {
+            fr->empty_qsets++;
+            continue;
+        }
+        slots += dev->qset;
+        for (i = 0; i < dev->qset; i++) {
+            if (!dptr->data[i])
+                continue;
+            used++;
+            pos = item * itemsize + (loff_t) i * dev->quantum;
+            len = dev->quantum;
+            if (scull_extent_locate(dev, pos, &len) || pos >= dev->size)
+                len = 0;
+            else
+                len = min_t(loff_t, len, dev->size - pos);
+            fr->slack_bytes += dev->quantum - len;
+        }
+        fr->quanta += used;
+        if (!used)
+            fr->empty_qsets++;
+    }
+    fr->empty_slots = slots - fr->quanta;
+    fr->occupancy = slots ? fr->quanta * 100 / slots : 100;
+    fr->slack_bytes += scull_extent_slack(dev);
+}
+
+/*
+ * Where a step is in the quantum list: the qset and the slot in it for
+ * the quantum at "pos". A step looks the position up once and then
+ * moves along the list, rather than walking it from the head for every
+ * slot with scull_slot().
+ */
+struct scull_compact_cur {
+    struct scull_qset *dptr;    /* NULL past the end of the list */
+    int s_pos;
+    loff_t pos;
+};
+
+static void scull_compact_seek(struct scull_dev *dev, struct scull_compact_cur *cur,
+        loff_t pos)
+{
+    int itemsize = dev->quantum * dev->qset;
+    long item = (long) pos / itemsize;
+
+    cur->dptr = dev->data;
+    while (cur->dptr && item--)
+        cur->dptr = cur->dptr->next;
+    cur->s_pos = ((long) pos % itemsize) / dev->quantum;
+    cur->pos = pos;
+}
+
+static void scull_compact_next(struct scull_dev *dev, struct scull_compact_cur *cur)
+{
+    cur->pos += dev->quantum;
+    if (++cur->s_pos == dev->qset) {
+        cur->s_pos = 0;
+        if (cur->dptr)
+            cur->dptr = cur->dptr->next;
+    }
+}
+
+/*
+ * Does a whole quantum of data sit at the cursor, in a quantum of its
+ * own?
+ */
+static int scull_compact_whole(struct scull_dev *dev, struct scull_compact_cur *cur)
+{
+    size_t len = dev->quantum;
+
+    if (cur->pos + dev->quantum > dev->size)
+        return 0;
+    if (!cur->dptr || !cur->dptr->data || !cur->dptr->data[cur->s_pos])
+        return 0;
+    return !scull_extent_locate(dev, cur->pos, &len) && len == dev->quantum;
+}
+
+/*
+ * One step of the compaction, from the quantum at *pos: find the next
+ * run of whole quanta and move up to SCULL_COMPACT_MAX of them into a
+ * new extent. Returns 0 once the end of the device is reached.
+ */
+static int scull_compact_step(struct scull_dev *dev, loff_t *pos)
+{
+    struct scull_compact_cur cur, run;
+    int quantum = dev->quantum;
+    int n, scanned = 0;
+    void **slot;
+    char *ext;
+
+    scull_compact_seek(dev, &cur, *pos);
+    while (!scull_compact_whole(dev, &cur)) {
+        if (cur.pos + quantum > dev->size)
+            return 0;
+        if (++scanned >= SCULL_COMPACT_SCAN) {
+            *pos = cur.pos;
+            return 1;
+        }
+        scull_compact_next(dev, &cur);
+    }
+
+    run = cur;
+    for (n = 0; n < SCULL_COMPACT_MAX && scull_compact_whole(dev, &run); n++)
+        scull_compact_next(dev, &run);
+    *pos = run.pos;
+    if (n < SCULL_COMPACT_MIN)
+        return 1;
+
+    ext = scull_extent_add(dev, cur.pos, (size_t) n * quantum);
+    if (!ext)
+        return 1;   /* no big block to be had: keep the quanta */
+    while (n--) {
+        slot = &cur.dptr->data[cur.s_pos];
+        memcpy(ext, *slot, quantum);
+        kfree(*slot);
+        *slot = NULL;
+        ext += quantum;
+        scull_compact_next(dev, &cur);
+    }
+    return 1;
+}
+
+/*
+ * Ring and kv devices keep pointers into their quanta, exported pages
+ * must stay where they are, and sealed devices are read without the
+ * mutex: none of these may be compacted.
+ */
+static int scull_compact_busy(struct scull_dev *dev)
+{
+    return dev->ring_quanta || dev->kv_mode || dev->exports || dev->sealed;
+}
+
+static void scull_compact_work(struct work_struct *work)
+{
+    struct scull_dev *dev = container_of(work, struct scull_dev, compact_work);
+    struct scull_frag before, after;
+    loff_t pos = 0;
+    int more = 1;
+
+    mutex_lock(&dev->mutex);
+    if (scull_compact_busy(dev)) {
+        mutex_unlock(&dev->mutex);
+        return;
+    }
+    scull_frag(dev, &before);
+    mutex_unlock(&dev->mutex);
+
+    while (more) {
+        mutex_lock(&dev->mutex);
+        /* the mode may have changed while we let go of the mutex */
+        more = !scull_compact_busy(dev) && scull_compact_step(dev, &pos);
+        mutex_unlock(&dev->mutex);
+        cond_resched();
+    }
+
+    mutex_lock(&dev->mutex);
+    if (!scull_compact_busy(dev))
+        scull_prune(dev);
+    scull_frag(dev, &after);
+    mutex_unlock(&dev->mutex);
+
+    PDEBUG("scull%i: compacted: quanta %lu -> %lu, empty slots %lu -> %lu, "
+           "slack %lu -> %lu bytes, occupancy %u%% -> %u%%\n",
+           (int) (dev - scull_devices), before.quanta, after.quanta,
+           before.empty_slots, after.empty_slots,
+           before.slack_bytes, after.slack_bytes,
+           before.occupancy, after.occupancy);
+}
+
+/*
+ * Start compacting the device in the background; with "wait", return
+ * only when it is done.
+ */
+int scull_compact(struct scull_dev *dev, int wait)
+{
+    if (scull_compact_busy(dev))
+        return -EBUSY;
+    schedule_work(&dev->compact_work);
+    if (wait)
+        flush_work(&dev->compact_work);
+    return 0;
+}
+
+static void scull_compact_tick(struct work_struct *work)
+{
+    int i, secs = READ_ONCE(scull_compact_secs);
+
+    if (secs <= 0)
+        return;
+    for (i = 0; i < scull_nr_devs; i++)
+        schedule_work(&scull_devices[i].compact_work);
+    schedule_delayed_work(&scull_compact_timer, secs * HZ);
+}
+
+void scull_compact_init(struct scull_dev *dev)
+{
+    INIT_WORK(&dev->compact_work, scull_compact_work);
+}
+
+/* Start the periodic compaction, if the module parameter asks for it */
+void scull_compact_start(void)
+{
+    mutex_lock(&scull_compact_lock);
+    scull_compact_running = 1;
+    if (scull_compact_secs > 0)
+        schedule_delayed_work(&scull_compact_timer, scull_compact_secs * HZ);
+    mutex_unlock(&scull_compact_lock);
+}
+
+/* Stop the periodic compaction */
+void scull_compact_stop(void)
+{
+    mutex_lock(&scull_compact_lock);
+    scull_compact_running = 0;
+    mutex_unlock(&scull_compact_lock);
+    cancel_delayed_work_sync(&scull_compact_timer);
+}
+
+/* Wait for a compaction of the device that may still be running */
+void scull_compact_cancel(struct scull_dev *dev)
+{
+    cancel_work_sync(&dev->compact_work);
+}
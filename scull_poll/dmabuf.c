@@ -0,0 +1,268 @@
+/*
+ * dmabuf.c -- export a range of a scull device as a dma-buf
+ *
+ * The exported buffer is made of the very pages that back the range:
+ * an importing driver gets them as a scatterlist, and mmap() of the
+ * dma-buf fd maps them into user space, so a writer, the importer and
+ * a user mapping all see the same memory and nothing is copied.
+ *
+ * Only whole pages can be shared, so the range must be page aligned
+ * and backed by page-aligned memory: extents, or quanta that are a
+ * multiple of PAGE_SIZE. Holes in the range are filled first. While
+ * a device has buffers out, nothing may free its memory: trims,
+ * truncating, compaction, mode changes and moving copies fail with
+ * -EBUSY until the last buffer is released.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>	/* printk(), min() */
+#include <linux/slab.h>		/* kmalloc() */
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/fs.h>		/* everything... */
+#include <linux/errno.h>	/* error codes */
+#include <linux/types.h>	/* size_t */
+#include <linux/fcntl.h>
+#include <linux/cdev.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+#include <linux/highmem.h>
+#include <asm/uaccess.h>
+
+#include "scull.h"		/* local definitions */
+
+struct scull_dmabuf {
+    struct scull_dev *dev;
+    struct page **pages;
+    unsigned long npages;
+};
+
+static struct sg_table *scull_dmabuf_map(struct dma_buf_attachment *attach,
+        enum dma_data_direction dir)
+{
+    struct scull_dmabuf *sb = attach->dmabuf->priv;
+    struct sg_table *sgt;
+    int err;
+
+    sgt = kmalloc(sizeof(struct sg_table), GFP_KERNEL);
+    if (!sgt)
+        return ERR_PTR(-ENOMEM);
+    err = sg_alloc_table_from_pages(sgt, sb->pages, sb->npages, 0,
+                                    sb->npages << PAGE_SHIFT, GFP_KERNEL);
+    if (err)
+        goto out_free;
+    err = -ENOMEM;
+    if (!dma_map_sg(attach->dev, sgt->sgl, sgt->orig_nents, dir))
+        goto out_table;
+    return sgt;
+
+out_table:
+    sg_free_table(sgt);
+out_free:
+    kfree(sgt);
+    return ERR_PTR(err);
+}
+
+static void scull_dmabuf_unmap(struct dma_buf_attachment *attach,
+        struct sg_table *sgt, enum dma_data_direction dir)
+{
+    dma_unmap_sg(attach->dev, sgt->sgl, sgt->orig_nents, dir);
+    sg_free_table(sgt);
+    kfree(sgt);
+}
+
+static void scull_dmabuf_release(struct dma_buf *dmabuf)
+{
+    struct scull_dmabuf *sb = dmabuf->priv;
+
+    mutex_lock(&sb->dev->mutex);
+    sb->dev->exports--;
+    mutex_unlock(&sb->dev->mutex);
+    kvfree(sb->pages);
+    kfree(sb);
+}
+
+static void *scull_dmabuf_kmap(struct dma_buf *dmabuf, unsigned long pgnum)
+{
+    struct scull_dmabuf *sb = dmabuf->priv;
+
+    return kmap(sb->pages[pgnum]);
+}
+
+static void scull_dmabuf_kunmap(struct dma_buf *dmabuf, unsigned long pgnum,
+        void *vaddr)
+{
+    struct scull_dmabuf *sb = dmabuf->priv;
+
+    kunmap(sb->pages[pgnum]);
+}
+
+static void *scull_dmabuf_vmap(struct dma_buf *dmabuf)
+{
+    struct scull_dmabuf *sb = dmabuf->priv;
+
+    return vmap(sb->pages, sb->npages, VM_MAP, PAGE_KERNEL);
+}
+
+static void scull_dmabuf_vunmap(struct dma_buf *dmabuf, void *vaddr)
+{
+    vunmap(vaddr);
+}
+
+/*
+ * Map the pages themselves. Quanta come from kmalloc(), which
+ * vm_insert_page() won't take, so go by page frame number instead.
+ */
+static int scull_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+    struct scull_dmabuf *sb = dmabuf->priv;
+    unsigned long addr = vma->vm_start, i;
+    int err;
+
+    if (vma->vm_pgoff + vma_pages(vma) > sb->npages)
+        return -EINVAL;
+    for (i = vma->vm_pgoff; addr < vma->vm_end; i++, addr += PAGE_SIZE) {
+        err = remap_pfn_range(vma, addr, page_to_pfn(sb->pages[i]),
+                              PAGE_SIZE, vma->vm_page_prot);
+        if (err)
+            return err;
+    }
+    return 0;
+}
+
+static const struct dma_buf_ops scull_dmabuf_ops = {
+    .map_dma_buf = scull_dmabuf_map,
+    .unmap_dma_buf = scull_dmabuf_unmap,
+    .release = scull_dmabuf_release,
+    .map = scull_dmabuf_kmap,
+    .unmap = scull_dmabuf_kunmap,
+    .vmap = scull_dmabuf_vmap,
+    .vunmap = scull_dmabuf_vunmap,
+    .mmap = scull_dmabuf_mmap,
+};
+
+/* The page behind a kmalloc()ed quantum or an extent */
+static struct page *scull_dmabuf_page(void *addr)
+{
+    return is_vmalloc_addr(addr) ? vmalloc_to_page(addr) : virt_to_page(addr);
+}
+
+/*
+ * Collect the pages behind the range, filling holes on the way; called
+ * with the device mutex held.
+ */
+static int scull_dmabuf_pages(struct scull_dev *dev, struct scull_dmabuf *sb,
+        loff_t offset)
+{
+    loff_t pos;
+    unsigned long i;
+    size_t len;
+    char *ptr;
+
+    for (i = 0; i < sb->npages; i++) {
+        pos = offset + (i << PAGE_SHIFT);
+        len = PAGE_SIZE;
+        ptr = scull_locate(dev, pos, &len, 0);
+        if (!ptr) {
+            /* a hole reads as zeros, and so must its new quantum */
+            ptr = scull_get_quantum(dev, pos);
+            if (!ptr)
+                return -ENOMEM;
+            memset(ptr, 0, dev->quantum);
+            ptr += (long) pos % dev->quantum;
+        }
+        if (offset_in_page(ptr) || len < PAGE_SIZE)
+            return -EINVAL;     /* not backed by whole pages */
+        /* whatever lies past the end of the data was never written */
+        if (pos + PAGE_SIZE > dev->size)
+            memset(ptr + (dev->size - pos), 0, pos + PAGE_SIZE - dev->size);
+        sb->pages[i] = scull_dmabuf_page(ptr);
+    }
+    return 0;
+}
+
+static int scull_export(struct scull_dev *dev, struct scull_export *ex)
+{
+    DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+    struct scull_dmabuf *sb;
+    struct dma_buf *dmabuf;
+    int err;
+
+    if (!ex->length || !PAGE_ALIGNED(ex->offset) || !PAGE_ALIGNED(ex->length)
+            || (ex->flags & ~(O_ACCMODE | O_CLOEXEC)))
+        return -EINVAL;
+    sb = kmalloc(sizeof(struct scull_dmabuf), GFP_KERNEL);
+    if (!sb)
+        return -ENOMEM;
+    sb->dev = dev;
+    sb->npages = ex->length >> PAGE_SHIFT;
+    sb->pages = kvmalloc_array(sb->npages, sizeof(struct page *), GFP_KERNEL);
+    if (!sb->pages) {
+        kfree(sb);
+        return -ENOMEM;
+    }
+
+    if (mutex_lock_interruptible(&dev->mutex)) {
+        err = -ERESTARTSYS;
+        goto out_free;
+    }
+    err = dev->sealed ? -EPERM : -EBUSY;
+    if (dev->sealed || dev->ring_quanta || dev->kv_mode)
+        goto out_unlock;
+    err = -EINVAL;
+    if (ex->offset > PAGE_ALIGN(dev->size)
+            || ex->length > PAGE_ALIGN(dev->size) - ex->offset)
+        goto out_unlock;    /* grow the device with SCULL_IOCTTRUNC first */
+    err = scull_dmabuf_pages(dev, sb, ex->offset);
+    if (err)
+        goto out_unlock;
+
+    exp_info.owner = THIS_MODULE;
+    exp_info.ops = &scull_dmabuf_ops;
+    exp_info.size = ex->length;
+    exp_info.flags = ex->flags & O_ACCMODE;
+    exp_info.priv = sb;
+    dmabuf = dma_buf_export(&exp_info);
+    if (IS_ERR(dmabuf)) {
+        err = PTR_ERR(dmabuf);
+        goto out_unlock;
+    }
+    dev->exports++;
+    mutex_unlock(&dev->mutex);
+
+    /* from here on, releasing the dma-buf frees "sb" */
+    ex->fd = dma_buf_fd(dmabuf, ex->flags & O_CLOEXEC);
+    if (ex->fd < 0) {
+        err = ex->fd;
+        dma_buf_put(dmabuf);
+        return err;
+    }
+    return 0;
+
+out_unlock:
+    mutex_unlock(&dev->mutex);
+out_free:
+    kvfree(sb->pages);
+    kfree(sb);
+    return err;
+}
+
+long scull_export_ioctl(struct file *filp, unsigned long arg)
+{
+    struct scull_dev *dev = filp->private_data;
+    struct scull_export ex;
+    int err;
+
+    if (copy_from_user(&ex, (void __user *)arg, sizeof(ex)))
+        return -EFAULT;
+    /* a writable buffer only for a file that may write */
+    if ((ex.flags & O_ACCMODE) != O_RDONLY && !(filp->f_mode & FMODE_WRITE))
+        return -EBADF;
+    err = scull_export(dev, &ex);
+    if (err)
+        return err;
+    if (put_user(ex.fd, &((struct scull_export __user *)arg)->fd))
+        return -EFAULT;     /* the fd stays installed, like open() racing close() */
+    return 0;
+}
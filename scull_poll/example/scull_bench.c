@@ -0,0 +1,1760 @@
+/*************************************************************************
+	> File Name: scull_bench.c
+	> Author: 
+	> Mail: 
+	> Created Time: 2026年10月19日 星期一 09时20分41秒
+ ************************************************************************/
+
+/*
+ * Micro-benchmarks for the scull devices. Every test is a subcommand:
+ *
+ *   ./scull_bench kv [/dev/scull0]      kv ops/sec against the key count
+ *   ./scull_bench seal [/dev/scull3]    read scaling before/after a seal
+ *   ./scull_bench copy [src] [dst]      user-space copy vs SCULL_IOCCOPY
+ *   ./scull_bench numa [/dev/scull0]    local vs remote read throughput
+ *   ./scull_bench extent [/dev/scull0]  quanta vs extents for a big stream
+ *   ./scull_bench compact [/dev/scull0] fragmentation and reads around a compaction
+ *   ./scull_bench dmabuf [/dev/scull0]  read() vs an mmap()ed dma-buf export
+ *   ./scull_bench hint [/dev/scull0]    throughput under each access hint
+ *   ./scull_bench pipe [p0] [p1]        scullpipe ping-pong latency and throughput
+ *   ./scull_bench record [/dev/scullpipe0] small messages: stream, records, batches
+ *   ./scull_bench splice [/dev/scullpipe0] read()+write() vs sendfile() to AF_UNIX
+ *   ./scull_bench pipesz [/dev/scullpipe0] resize with data in it, throughput per size
+ *   ./scull_bench lowat [/dev/scullpipe0] reader wakeups per MB with and without a low watermark
+ *   ./scull_bench herd [/dev/scullpipe0] message rate and wakeups with 1..16 blocked readers
+ *   ./scull_bench pollat [/dev/scullpipe0] cost of poll() on an idle and on a busy pipe
+ *   ./scull_bench bcast [/dev/scullpipe0] fan-out to 4 readers; a slow reader under overrun
+ *   ./scull_bench prio [/dev/scullpipe0] control message latency under bulk load, per priority
+ *   ./scull_bench busy [/dev/scullpipe0] latency percentiles with and without busy polling
+ *   ./scull_bench timeo [p0] [p1]       request/response with poll()+read() vs a receive timeout
+ *   ./scull_bench reopen [/dev/scullpipe0] open/close rate, pooled vs persistent buffer
+ *   ./scull_bench mirror [/dev/scullpipe0] big transfers: paged vs mirrored ring vs mmap() reader
+ *   ./scull_bench lat [/dev/scullpipe0] histogram of the time data waits in the pipe
+ *
+ * Build with: gcc -O2 -o scull_bench scull_bench.c -lpthread
+ */
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <linux/dma-buf.h>
+#include "../scull_ioctl.h"
+
+#define ARRAY_SIZE(a) ((int) (sizeof(a) / sizeof((a)[0])))
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int open_dev(const char *name, int flags)
+{
+    int fd = open(name, flags);
+
+    if (fd < 0)
+        fprintf(stderr, "open %s: %s\n", name, strerror(errno));
+    return fd;
+}
+
+/*
+ * kv: fill the store with N keys, then time random GETs and batched
+ * MULTI-GETs. With the hash index the rate should barely move as the
+ * key count grows.
+ */
+#define KV_VLEN     64
+#define KV_GETS     200000
+#define KV_BATCH    32
+
+static int bench_kv(int argc, char *argv[])
+{
+    static const int counts[] = { 1000, 10000, 100000 };
+    struct scull_kv_op ops[KV_BATCH];
+    char keys[KV_BATCH][16], vals[KV_BATCH][KV_VLEN];
+    char key[16], val[KV_VLEN];
+    struct scull_kv_op op;
+    struct scull_kv_mget mg;
+    double t, put, get, mget;
+    int fd, i, j, n, c;
+
+    fd = open_dev(argc > 0 ? argv[0] : "/dev/scull0", O_RDWR);
+    if (fd < 0)
+        return 1;
+    memset(val, 'v', sizeof(val));
+
+    printf("%8s %12s %12s %12s\n", "keys", "put/s", "get/s", "mget/s");
+    for (c = 0; c < ARRAY_SIZE(counts); c++) {
+        n = counts[c];
+        if (ioctl(fd, SCULL_IOCTKV, 1) < 0) {
+            perror("SCULL_IOCTKV");
+            return 1;
+        }
+
+        t = now();
+        for (i = 0; i < n; i++) {
+            op.klen = sprintf(key, "key%08d", i);
+            op.key = key;
+            op.val = val;
+            op.vlen = KV_VLEN;
+            if (ioctl(fd, SCULL_IOCKVPUT, &op) < 0) {
+                perror("SCULL_IOCKVPUT");
+                return 1;
+            }
+        }
+        put = n / (now() - t);
+
+        t = now();
+        for (i = 0; i < KV_GETS; i++) {
+            op.klen = sprintf(key, "key%08d", rand() % n);
+            op.key = key;
+            op.val = val;
+            op.vlen = KV_VLEN;
+            if (ioctl(fd, SCULL_IOCKVGET, &op) < 0) {
+                perror("SCULL_IOCKVGET");
+                return 1;
+            }
+        }
+        get = KV_GETS / (now() - t);
+
+        t = now();
+        for (i = 0; i < KV_GETS; i += KV_BATCH) {
+            for (j = 0; j < KV_BATCH; j++) {
+                ops[j].klen = sprintf(keys[j], "key%08d", rand() % n);
+                ops[j].key = keys[j];
+                ops[j].val = vals[j];
+                ops[j].vlen = KV_VLEN;
+            }
+            mg.ops = ops;
+            mg.nops = KV_BATCH;
+            if (ioctl(fd, SCULL_IOCKVMGET, &mg) != KV_BATCH) {
+                perror("SCULL_IOCKVMGET");
+                return 1;
+            }
+        }
+        mget = KV_GETS / (now() - t);
+
+        printf("%8d %12.0f %12.0f %12.0f\n", n, put, get, mget);
+    }
+    ioctl(fd, SCULL_IOCTKV, 0);
+    close(fd);
+    return 0;
+}
+
+/*
+ * seal: fill a device, then read it from 1..8 threads at once, first
+ * through the mutex and then again once the device is sealed. Sealing
+ * can't be undone, so this uses the last scull device by default.
+ */
+#define SEAL_SIZE   (16 << 20)
+#define SEAL_PASSES 8
+
+static const char *seal_dev;
+
+static void *seal_reader(void *arg)
+{
+    char buf[65536];
+    int fd, i;
+
+    (void) arg;
+    fd = open_dev(seal_dev, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    for (i = 0; i < SEAL_PASSES; i++) {
+        lseek(fd, 0, SEEK_SET);
+        while (read(fd, buf, sizeof(buf)) > 0)
+            ;
+    }
+    close(fd);
+    return NULL;
+}
+
+static void seal_run(const char *what)
+{
+    pthread_t tid[8];
+    double t;
+    int n, i;
+
+    for (n = 1; n <= 8; n *= 2) {
+        t = now();
+        for (i = 0; i < n; i++)
+            pthread_create(&tid[i], NULL, seal_reader, NULL);
+        for (i = 0; i < n; i++)
+            pthread_join(tid[i], NULL);
+        t = now() - t;
+        printf("%-9s %2d readers %10.1f MB/s\n", what, n,
+               (double) n * SEAL_PASSES * SEAL_SIZE / t / (1 << 20));
+    }
+}
+
+static int bench_seal(int argc, char *argv[])
+{
+    char buf[4000];
+    int fd, i;
+
+    seal_dev = argc > 0 ? argv[0] : "/dev/scull3";
+    fd = open_dev(seal_dev, O_RDWR);
+    if (fd < 0)
+        return 1;
+    if (ioctl(fd, SCULL_IOCQSEAL) == 0) {
+        /* an O_WRONLY open empties the device */
+        close(open_dev(seal_dev, O_WRONLY));
+        memset(buf, 's', sizeof(buf));
+        for (i = 0; i < SEAL_SIZE; i += sizeof(buf))
+            if (write(fd, buf, sizeof(buf)) < 0) {
+                perror("write");
+                return 1;
+            }
+        seal_run("unsealed");
+        if (ioctl(fd, SCULL_IOCSEAL) < 0) {
+            perror("SCULL_IOCSEAL");
+            return 1;
+        }
+    }
+    seal_run("sealed");
+    close(fd);
+    return 0;
+}
+
+/*
+ * copy: move a device's contents to another one through a user buffer,
+ * with SCULL_IOCCOPY, and with SCULL_IOCCOPY moving whole quanta.
+ */
+#define COPY_SIZE   (64 << 20)
+
+/* empty a device (an O_WRONLY open trims it) and return a r/w fd */
+static int reopen_empty(const char *name)
+{
+    close(open_dev(name, O_WRONLY));
+    return open_dev(name, O_RDWR);
+}
+
+static int bench_copy(int argc, char *argv[])
+{
+    const char *src_name = argc > 0 ? argv[0] : "/dev/scull0";
+    const char *dst_name = argc > 1 ? argv[1] : "/dev/scull1";
+    struct scull_copy_range cr;
+    char buf[4000];
+    int src, dst, i, move;
+    ssize_t n;
+    double t;
+
+    src = reopen_empty(src_name);
+    dst = reopen_empty(dst_name);
+    if (src < 0 || dst < 0)
+        return 1;
+    memset(buf, 'c', sizeof(buf));
+    for (i = 0; i < COPY_SIZE; i += sizeof(buf))
+        if (write(src, buf, sizeof(buf)) < 0) {
+            perror("write");
+            return 1;
+        }
+
+    t = now();
+    lseek(src, 0, SEEK_SET);
+    while ((n = read(src, buf, sizeof(buf))) > 0)
+        if (write(dst, buf, n) != n) {
+            perror("write");
+            return 1;
+        }
+    printf("%-12s %10.1f MB/s\n", "read/write",
+           COPY_SIZE / (now() - t) / (1 << 20));
+
+    for (move = 0; move <= 1; move++) {
+        close(dst);
+        dst = reopen_empty(dst_name);
+        memset(&cr, 0, sizeof(cr));
+        cr.src_fd = src;
+        cr.src_length = COPY_SIZE;
+        cr.flags = move ? SCULL_COPY_MOVE : 0;
+        t = now();
+        if (ioctl(dst, SCULL_IOCCOPY, &cr) || cr.copied != COPY_SIZE) {
+            perror("SCULL_IOCCOPY");
+            return 1;
+        }
+        printf("%-12s %10.1f MB/s\n", move ? "ioctl move" : "ioctl copy",
+               COPY_SIZE / (now() - t) / (1 << 20));
+    }
+    close(src);
+    close(dst);
+    return 0;
+}
+
+/*
+ * numa: put the whole device on node 0, then read it back from a CPU
+ * of every node in turn.
+ */
+#define NUMA_SIZE   (64 << 20)
+#define NUMA_PASSES 4
+
+/* first CPU of a NUMA node, -1 if there is no such node */
+static int node_cpu(int node)
+{
+    char path[64];
+    FILE *f;
+    int cpu = -1;
+
+    sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    if (fscanf(f, "%d", &cpu) != 1)
+        cpu = -1;
+    fclose(f);
+    return cpu;
+}
+
+static int bench_numa(int argc, char *argv[])
+{
+    const char *name = argc > 0 ? argv[0] : "/dev/scull0";
+    struct scull_numa numa = { SCULL_NUMA_NODE, 0 };
+    struct scull_numa_stat st;
+    char buf[4000];
+    cpu_set_t set;
+    int fd, i, node, cpu;
+    double t;
+
+    fd = reopen_empty(name);
+    if (fd < 0)
+        return 1;
+    if (ioctl(fd, SCULL_IOCSNUMA, &numa) < 0) {
+        perror("SCULL_IOCSNUMA");
+        return 1;
+    }
+    memset(buf, 'n', sizeof(buf));
+    for (i = 0; i < NUMA_SIZE; i += sizeof(buf))
+        if (write(fd, buf, sizeof(buf)) < 0) {
+            perror("write");
+            return 1;
+        }
+    if (ioctl(fd, SCULL_IOCGNUMASTAT, &st) == 0) {
+        printf("quanta per node:");
+        for (i = 0; i < SCULL_NUMA_NODES; i++)
+            printf(" %lu", st.quanta[i]);
+        printf("\nextent pages per node:");
+        for (i = 0; i < SCULL_NUMA_NODES; i++)
+            printf(" %lu", st.extent_pages[i]);
+        printf("\n");
+    }
+
+    for (node = 0; (cpu = node_cpu(node)) >= 0; node++) {
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+            perror("sched_setaffinity");
+            return 1;
+        }
+        t = now();
+        for (i = 0; i < NUMA_PASSES; i++) {
+            lseek(fd, 0, SEEK_SET);
+            while (read(fd, buf, sizeof(buf)) > 0)
+                ;
+        }
+        printf("data on node 0, reader on node %d (cpu %d): %10.1f MB/s\n",
+               node, cpu, (double) NUMA_PASSES * NUMA_SIZE / (now() - t) / (1 << 20));
+    }
+    numa.policy = SCULL_NUMA_LOCAL;
+    ioctl(fd, SCULL_IOCSNUMA, &numa);
+    close(fd);
+    return 0;
+}
+
+/*
+ * Write all of buf, however little the driver takes per call.
+ */
+static int write_all(int fd, const char *buf, size_t count)
+{
+    ssize_t n;
+
+    while (count) {
+        n = write(fd, buf, count);
+        if (n < 0) {
+            perror("write");
+            return -1;
+        }
+        buf += n;
+        count -= n;
+    }
+    return 0;
+}
+
+/*
+ * extent: stream 256MB into a device in 64KB writes and read it back,
+ * once with quanta only and once in extent mode.
+ */
+#define EXTENT_SIZE (256 << 20)
+
+static int bench_extent(int argc, char *argv[])
+{
+    const char *name = argc > 0 ? argv[0] : "/dev/scull0";
+    static char buf[65536];
+    struct scull_stat st;
+    double wr, rd;
+    int fd, i, mode;
+
+    memset(buf, 'e', sizeof(buf));
+    printf("%-8s %10s %10s %10s %12s %12s\n", "mode", "allocs", "quanta",
+           "extents", "write MB/s", "read MB/s");
+    for (mode = 0; mode <= 1; mode++) {
+        fd = reopen_empty(name);
+        if (fd < 0)
+            return 1;
+        if (ioctl(fd, SCULL_IOCTEXTENT, mode) < 0) {
+            perror("SCULL_IOCTEXTENT");
+            return 1;
+        }
+        wr = now();
+        for (i = 0; i < EXTENT_SIZE; i += sizeof(buf))
+            if (write_all(fd, buf, sizeof(buf)) < 0)
+                return 1;
+        wr = EXTENT_SIZE / (now() - wr) / (1 << 20);
+
+        rd = now();
+        lseek(fd, 0, SEEK_SET);
+        while (read(fd, buf, sizeof(buf)) > 0)
+            ;
+        rd = EXTENT_SIZE / (now() - rd) / (1 << 20);
+
+        if (ioctl(fd, SCULL_IOCGSTAT, &st) < 0) {
+            perror("SCULL_IOCGSTAT");
+            return 1;
+        }
+        printf("%-8s %10lu %10lu %10lu %12.1f %12.1f\n",
+               mode ? "extents" : "quanta", st.allocs, st.quanta,
+               st.extents, wr, rd);
+        ioctl(fd, SCULL_IOCTEXTENT, 0);
+        close(fd);
+    }
+    return 0;
+}
+
+/*
+ * compact: write 64KB chunks with 32KB holes between them, then compare
+ * the fragmentation metrics and the read rate before and after a
+ * (waited for) compaction.
+ */
+#define COMPACT_CHUNK   (64 * 1024)
+#define COMPACT_STRIDE  (96 * 1024)
+#define COMPACT_SIZE    (32 << 20)
+
+static double read_rate(int fd)
+{
+    static char buf[65536];
+    double t = now();
+    long total = 0;
+    ssize_t n;
+
+    lseek(fd, 0, SEEK_SET);
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        total += n;
+    return total / (now() - t) / (1 << 20);
+}
+
+static void print_frag(const char *when, struct scull_frag *fr, double rd)
+{
+    printf("%-8s %10lu %10lu %12lu %12lu %8u%% %12.1f\n", when, fr->quanta,
+           fr->qsets, fr->empty_slots, fr->slack_bytes, fr->occupancy, rd);
+}
+
+static int bench_compact(int argc, char *argv[])
+{
+    const char *name = argc > 0 ? argv[0] : "/dev/scull0";
+    static char buf[COMPACT_CHUNK];
+    struct scull_frag fr;
+    double t, rd;
+    int fd, off;
+
+    fd = reopen_empty(name);
+    if (fd < 0)
+        return 1;
+    memset(buf, 'c', sizeof(buf));
+    for (off = 0; off < COMPACT_SIZE; off += COMPACT_STRIDE)
+        if (pwrite(fd, buf, sizeof(buf), off) != sizeof(buf)) {
+            perror("pwrite");
+            return 1;
+        }
+
+    printf("%-8s %10s %10s %12s %12s %9s %12s\n", "", "quanta", "qsets",
+           "empty slots", "slack", "occupancy", "read MB/s");
+    rd = read_rate(fd);
+    if (ioctl(fd, SCULL_IOCGFRAG, &fr) < 0) {
+        perror("SCULL_IOCGFRAG");
+        return 1;
+    }
+    print_frag("before", &fr, rd);
+
+    t = now();
+    if (ioctl(fd, SCULL_IOCTCOMPACT, 1) < 0) {
+        perror("SCULL_IOCTCOMPACT");
+        return 1;
+    }
+    t = now() - t;
+    rd = read_rate(fd);
+    ioctl(fd, SCULL_IOCGFRAG, &fr);
+    print_frag("after", &fr, rd);
+    printf("compaction took %.1f ms\n", t * 1e3);
+    close(fd);
+    return 0;
+}
+
+/*
+ * dmabuf: export an extent-backed range and compare reading it with
+ * read() against summing it through a mapping of the dma-buf, then
+ * check that a store through the mapping shows up in read().
+ */
+#define DMABUF_SIZE     (16 << 20)
+
+static int bench_dmabuf(int argc, char *argv[])
+{
+    const char *name = argc > 0 ? argv[0] : "/dev/scull0";
+    static char buf[65536];
+    struct dma_buf_sync sync;
+    struct scull_export ex;
+    unsigned long sum = 0;
+    double rd, mm;
+    char *map, c;
+    int fd, i;
+
+    fd = reopen_empty(name);
+    if (fd < 0)
+        return 1;
+    ioctl(fd, SCULL_IOCTEXTENT, 1);
+    memset(buf, 'd', sizeof(buf));
+    for (i = 0; i < DMABUF_SIZE; i += sizeof(buf))
+        if (write_all(fd, buf, sizeof(buf)) < 0)
+            return 1;
+
+    memset(&ex, 0, sizeof(ex));
+    ex.length = DMABUF_SIZE;
+    ex.flags = O_RDWR | O_CLOEXEC;
+    if (ioctl(fd, SCULL_IOCEXPORT, &ex) < 0) {
+        perror("SCULL_IOCEXPORT");
+        return 1;
+    }
+    map = mmap(NULL, DMABUF_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, ex.fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    rd = now();
+    lseek(fd, 0, SEEK_SET);
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+    rd = DMABUF_SIZE / (now() - rd) / (1 << 20);
+
+    sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW;
+    ioctl(ex.fd, DMA_BUF_IOCTL_SYNC, &sync);
+    mm = now();
+    for (i = 0; i < DMABUF_SIZE; i += sizeof(long))
+        sum += *(unsigned long *) (map + i);
+    mm = DMABUF_SIZE / (now() - mm) / (1 << 20);
+    map[12345] = 'x';
+    sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW;
+    ioctl(ex.fd, DMA_BUF_IOCTL_SYNC, &sync);
+
+    if (pread(fd, &c, 1, 12345) != 1 || c != 'x') {
+        fprintf(stderr, "store through the dma-buf not seen by read()\n");
+        return 1;
+    }
+    printf("read() %.1f MB/s, dma-buf mapping %.1f MB/s (sum %lx), shared: yes\n",
+           rd, mm, sum);
+    munmap(map, DMABUF_SIZE);
+    close(ex.fd);
+    ioctl(fd, SCULL_IOCTEXTENT, 0);
+    close(fd);
+    return 0;
+}
+
+/*
+ * hint: under each access hint, time a sequential write, a sequential
+ * read and random 4KB reads of the same data.
+ */
+#define HINT_SIZE       (64 << 20)
+#define HINT_RANDOM     20000
+
+static int bench_hint(int argc, char *argv[])
+{
+    static const char *names[] = {
+        "normal", "sequential", "random", "writeonce", "willneed"
+    };
+    const char *name = argc > 0 ? argv[0] : "/dev/scull0";
+    static char buf[65536];
+    double wr, rd, rnd;
+    int fd, h, i;
+
+    memset(buf, 'h', sizeof(buf));
+    printf("%-10s %12s %12s %12s\n", "hint", "write MB/s",
+           "read MB/s", "4KB reads/s");
+    for (h = 0; h < ARRAY_SIZE(names); h++) {
+        fd = open_dev(name, O_RDWR);
+        if (fd < 0)
+            return 1;
+        if (ioctl(fd, SCULL_IOCTHINT, h) < 0) {
+            perror("SCULL_IOCTHINT");
+            return 1;
+        }
+        close(fd);
+        fd = reopen_empty(name);    /* the trim picks the hint's quantum */
+        if (fd < 0)
+            return 1;
+
+        wr = now();
+        for (i = 0; i < HINT_SIZE; i += sizeof(buf))
+            if (write_all(fd, buf, sizeof(buf)) < 0)
+                return 1;
+        wr = HINT_SIZE / (now() - wr) / (1 << 20);
+
+        rd = now();
+        lseek(fd, 0, SEEK_SET);
+        while (read(fd, buf, sizeof(buf)) > 0)
+            ;
+        rd = HINT_SIZE / (now() - rd) / (1 << 20);
+
+        srand(h);
+        rnd = now();
+        for (i = 0; i < HINT_RANDOM; i++)
+            pread(fd, buf, 4096, (off_t) (rand() % (HINT_SIZE / 4096)) * 4096);
+        rnd = HINT_RANDOM / (now() - rnd);
+
+        printf("%-10s %12.1f %12.1f %12.0f\n", names[h], wr, rd, rnd);
+        ioctl(fd, SCULL_IOCTHINT, SCULL_HINT_NORMAL);
+        close(fd);
+    }
+    return 0;
+}
+
+/*
+ * pipe: one writer and one reader thread. Latency is half the round
+ * trip of an 8-byte message bounced over two pipes; throughput is a
+ * stream of 4KB writes through one.
+ */
+#define PIPE_PINGS      100000
+#define PIPE_SIZE       (256 << 20)
+
+struct pipe_args {
+    const char *p0, *p1;
+    int count;
+};
+
+static int read_full(int fd, void *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = read(fd, buf, len);
+        if (n <= 0)
+            return -1;
+        buf = (char *) buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Bounce every message back from p0 to p1 */
+static void *pipe_echo(void *arg)
+{
+    struct pipe_args *pa = arg;
+    int in = open_dev(pa->p0, O_RDONLY), out = open_dev(pa->p1, O_WRONLY);
+    long msg;
+    int i;
+
+    for (i = 0; i < pa->count && in >= 0 && out >= 0; i++)
+        if (read_full(in, &msg, sizeof(msg)) < 0
+                || write_all(out, (char *) &msg, sizeof(msg)) < 0)
+            break;
+    close(in);
+    close(out);
+    return NULL;
+}
+
+/* Drain PIPE_SIZE bytes from p0, counting the read() calls */
+static long drain_reads;
+
+static void *pipe_drain(void *arg)
+{
+    struct pipe_args *pa = arg;
+    static char buf[65536];
+    int fd = open_dev(pa->p0, O_RDONLY);
+    long total = 0;
+    ssize_t n;
+
+    drain_reads = 0;
+    while (fd >= 0 && total < PIPE_SIZE && (n = read(fd, buf, sizeof(buf))) > 0) {
+        total += n;
+        drain_reads++;
+    }
+    close(fd);
+    return NULL;
+}
+
+static int bench_pipe(int argc, char *argv[])
+{
+    struct pipe_args pa = {
+        argc > 0 ? argv[0] : "/dev/scullpipe0",
+        argc > 1 ? argv[1] : "/dev/scullpipe1",
+        PIPE_PINGS
+    };
+    static char buf[4096];
+    pthread_t tid;
+    double t;
+    long msg;
+    int out, in, i;
+
+    pthread_create(&tid, NULL, pipe_echo, &pa);
+    out = open_dev(pa.p0, O_WRONLY);
+    in = open_dev(pa.p1, O_RDONLY);
+    if (out < 0 || in < 0)
+        return 1;
+    t = now();
+    for (msg = 0; msg < PIPE_PINGS; msg++)
+        if (write_all(out, (char *) &msg, sizeof(msg)) < 0
+                || read_full(in, &msg, sizeof(msg)) < 0)
+            return 1;
+    t = now() - t;
+    pthread_join(tid, NULL);
+    close(in);
+    close(out);
+    printf("latency: %.2f us per message\n", t / PIPE_PINGS / 2 * 1e6);
+
+    pthread_create(&tid, NULL, pipe_drain, &pa);
+    out = open_dev(pa.p0, O_WRONLY);
+    if (out < 0)
+        return 1;
+    t = now();
+    for (i = 0; i < PIPE_SIZE; i += sizeof(buf))
+        if (write_all(out, buf, sizeof(buf)) < 0)
+            return 1;
+    pthread_join(tid, NULL);
+    t = now() - t;
+    close(out);
+    printf("throughput: %.1f MB/s, %.1f reads per MB\n", PIPE_SIZE / t / (1 << 20),
+           drain_reads / (double) (PIPE_SIZE >> 20));
+    return 0;
+}
+
+/*
+ * record: push small messages through a pipe, read back as a byte
+ * stream, as one record per read() and in RECVMMSG batches.
+ */
+#define REC_LEN     64
+#define REC_COUNT   1000000
+#define REC_BATCH   64
+
+static void *record_writer(void *arg)
+{
+    struct pipe_args *pa = arg;
+    char msg[REC_LEN];
+    int fd = open_dev(pa->p0, O_WRONLY), i;
+
+    memset(msg, 'r', sizeof(msg));
+    for (i = 0; i < pa->count && fd >= 0; i++)
+        if (write_all(fd, msg, sizeof(msg)) < 0)
+            break;
+    close(fd);
+    return NULL;
+}
+
+static int bench_record(int argc, char *argv[])
+{
+    static const char *modes[] = { "stream", "record", "recvmmsg" };
+    struct pipe_args pa = {
+        argc > 0 ? argv[0] : "/dev/scullpipe0", NULL, REC_COUNT
+    };
+    static char buf[REC_LEN * REC_BATCH];
+    unsigned int lens[REC_BATCH];
+    struct scull_p_mmsg mm;
+    pthread_t tid;
+    long got, bytes;
+    double t;
+    int fd, m, n;
+
+    for (m = 0; m < ARRAY_SIZE(modes); m++) {
+        fd = open_dev(pa.p0, O_RDONLY);
+        if (fd < 0)
+            return 1;
+        if (ioctl(fd, SCULL_P_IOCTRECORD, m ? REC_LEN : 0) < 0) {
+            perror("SCULL_P_IOCTRECORD");
+            return 1;
+        }
+        pthread_create(&tid, NULL, record_writer, &pa);
+        t = now();
+        for (got = bytes = 0; got < REC_COUNT; ) {
+            if (m == 2) {
+                mm.buf = buf;
+                mm.len = sizeof(buf);
+                mm.lens = lens;
+                mm.nrecs = REC_BATCH;
+                n = ioctl(fd, SCULL_P_IOCRECVMMSG, &mm);
+            } else {
+                n = read(fd, buf, m ? REC_LEN : sizeof(buf));
+            }
+            if (n < 0) {
+                perror(modes[m]);
+                return 1;
+            }
+            /* a stream counts bytes, the others whole records */
+            if (m)
+                got += n;
+            else
+                got = (bytes += n) / REC_LEN;
+        }
+        t = now() - t;
+        pthread_join(tid, NULL);
+        ioctl(fd, SCULL_P_IOCTRECORD, 0);
+        close(fd);
+        printf("%-9s %10.0f messages/s\n", modes[m], REC_COUNT / t);
+    }
+    return 0;
+}
+
+/*
+ * splice: move PIPE_SIZE bytes from a scullpipe into an AF_UNIX
+ * socket, with read() and write() through a user buffer, then with
+ * sendfile(), which gets whole pages handed over by splice_read.
+ */
+static void *splice_fill(void *arg)
+{
+    struct pipe_args *pa = arg;
+    static char buf[65536];
+    int fd = open_dev(pa->p0, O_WRONLY), i;
+
+    for (i = 0; i < PIPE_SIZE && fd >= 0; i += sizeof(buf))
+        if (write_all(fd, buf, sizeof(buf)) < 0)
+            break;
+    close(fd);
+    return NULL;
+}
+
+static void *splice_sink(void *arg)
+{
+    static char buf[65536];
+    int fd = *(int *) arg;
+    long total = 0;
+    ssize_t n;
+
+    while (total < PIPE_SIZE && (n = read(fd, buf, sizeof(buf))) > 0)
+        total += n;
+    return NULL;
+}
+
+static int bench_splice(int argc, char *argv[])
+{
+    struct pipe_args pa = { argc > 0 ? argv[0] : "/dev/scullpipe0", NULL, 0 };
+    static char buf[65536];
+    pthread_t filler, sinker;
+    int sv[2], fd, m;
+    long total;
+    ssize_t n;
+    double t;
+
+    for (m = 0; m <= 1; m++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+            perror("socketpair");
+            return 1;
+        }
+        fd = open_dev(pa.p0, O_RDONLY);
+        if (fd < 0)
+            return 1;
+        pthread_create(&filler, NULL, splice_fill, &pa);
+        pthread_create(&sinker, NULL, splice_sink, &sv[1]);
+        t = now();
+        for (total = 0; total < PIPE_SIZE; total += n) {
+            if (m)
+                n = sendfile(sv[0], fd, NULL, PIPE_SIZE - total);
+            else if ((n = read(fd, buf, sizeof(buf))) > 0)
+                n = write_all(sv[0], buf, n) < 0 ? -1 : n;
+            if (n <= 0) {
+                perror(m ? "sendfile" : "read/write");
+                return 1;
+            }
+        }
+        pthread_join(sinker, NULL);
+        t = now() - t;
+        pthread_join(filler, NULL);
+        close(fd);
+        close(sv[0]);
+        close(sv[1]);
+        printf("%-12s %10.1f MB/s\n", m ? "sendfile" : "read+write",
+               PIPE_SIZE / t / (1 << 20));
+    }
+    return 0;
+}
+
+/*
+ * pipesz: check that a resize keeps the data, then stream through the
+ * pipe at a few buffer sizes and show how full the buffer got.
+ */
+static int bench_pipesz(int argc, char *argv[])
+{
+    struct pipe_args pa = { argc > 0 ? argv[0] : "/dev/scullpipe0", NULL, 0 };
+    static const int sizes[] = { 4096, 65536, 1 << 20, 4 << 20 };
+    static char buf[65536], back[3000];
+    struct scull_p_stat st;
+    unsigned long full;
+    pthread_t tid;
+    double t;
+    int out, in, i, j;
+
+    out = open_dev(pa.p0, O_WRONLY);
+    if (out < 0)
+        return 1;
+    for (i = 0; i < (int) sizeof(back); i++)
+        buf[i] = i;
+    /* wrap the data around the end of a 4 KB ring, then grow it */
+    ioctl(out, SCULL_P_IOCTPIPESZ, 4096);
+    in = open_dev(pa.p0, O_RDONLY);
+    if (in < 0 || write_all(out, buf, 3000) < 0 || read_full(in, back, 3000) < 0
+            || write_all(out, buf, sizeof(back)) < 0)
+        return 1;
+    if (ioctl(out, SCULL_P_IOCTPIPESZ, 1 << 20) < 0) {
+        perror("SCULL_P_IOCTPIPESZ");
+        return 1;
+    }
+    if (read_full(in, back, sizeof(back)) < 0)
+        return 1;
+    printf("resize with data: %s\n", memcmp(buf, back, sizeof(back)) ? "CORRUPTED" : "kept");
+    close(in);
+
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        if (ioctl(out, SCULL_P_IOCTPIPESZ, sizes[i]) < 0) {
+            perror("SCULL_P_IOCTPIPESZ");
+            break;
+        }
+        ioctl(out, SCULL_P_IOCGSTAT, &st);
+        full = st.full;
+        pthread_create(&tid, NULL, pipe_drain, &pa);
+        t = now();
+        for (j = 0; j < PIPE_SIZE; j += sizeof(buf))
+            if (write_all(out, buf, sizeof(buf)) < 0)
+                return 1;
+        pthread_join(tid, NULL);
+        t = now() - t;
+        ioctl(out, SCULL_P_IOCGSTAT, &st);
+        printf("%8u bytes: %8.1f MB/s, peak %u bytes, writer found it full %lu times\n",
+               st.size, PIPE_SIZE / t / (1 << 20), st.peak, st.full - full);
+    }
+    close(out);
+    return 0;
+}
+
+/*
+ * lowat: a writer trickles small pieces into the pipe; the reader asks
+ * for big reads and counts its reads and context switches, first with
+ * the default low watermark and then with a high one.
+ */
+#define LOWAT_PIECE     512
+#define LOWAT_SIZE      (64 << 20)
+
+static int lowat_mark;
+static long lowat_reads, lowat_csw;
+
+static void *lowat_drain(void *arg)
+{
+    struct pipe_args *pa = arg;
+    static char buf[65536];
+    struct rusage ru0, ru1;
+    int fd = open_dev(pa->p0, O_RDONLY);
+    long total = 0;
+    ssize_t n;
+
+    if (fd < 0 || ioctl(fd, SCULL_P_IOCTRCVLOWAT, lowat_mark) < 0) {
+        perror("SCULL_P_IOCTRCVLOWAT");
+        exit(1);
+    }
+    lowat_reads = 0;
+    getrusage(RUSAGE_THREAD, &ru0);
+    while (total < LOWAT_SIZE && (n = read(fd, buf, sizeof(buf))) > 0) {
+        total += n;
+        lowat_reads++;
+    }
+    getrusage(RUSAGE_THREAD, &ru1);
+    lowat_csw = ru1.ru_nvcsw - ru0.ru_nvcsw;
+    close(fd);
+    return NULL;
+}
+
+static int bench_lowat(int argc, char *argv[])
+{
+    struct pipe_args pa = { argc > 0 ? argv[0] : "/dev/scullpipe0", NULL, 0 };
+    static const int marks[] = { 1, 32768 };
+    static char buf[LOWAT_PIECE];
+    pthread_t tid;
+    double t;
+    int out, i, j;
+
+    out = open_dev(pa.p0, O_WRONLY);
+    if (out < 0)
+        return 1;
+    ioctl(out, SCULL_P_IOCTPIPESZ, 1 << 20);
+    for (i = 0; i < ARRAY_SIZE(marks); i++) {
+        lowat_mark = marks[i];
+        pthread_create(&tid, NULL, lowat_drain, &pa);
+        t = now();
+        for (j = 0; j < LOWAT_SIZE; j += sizeof(buf))
+            if (write_all(out, buf, sizeof(buf)) < 0)
+                return 1;
+        pthread_join(tid, NULL);
+        t = now() - t;
+        printf("rcvlowat %6d: %8.1f MB/s, %8.1f reads/MB, %8.1f reader context switches/MB\n",
+               lowat_mark, LOWAT_SIZE / t / (1 << 20),
+               lowat_reads / (double) (LOWAT_SIZE >> 20),
+               lowat_csw / (double) (LOWAT_SIZE >> 20));
+    }
+    close(out);
+    return 0;
+}
+
+/*
+ * herd: a pool of readers blocks on one pipe in record mode and the
+ * writer sends small messages. With exclusive wakeups, each message
+ * should wake one reader however many are waiting. A record of
+ * length 0 tells a reader to stop.
+ */
+#define HERD_MSGS   200000
+#define HERD_MAX    16
+
+static const char *herd_dev;
+static long herd_csw[HERD_MAX];
+
+static void *herd_reader(void *arg)
+{
+    long id = (long) arg;
+    struct rusage ru0, ru1;
+    char msg[REC_LEN];
+    int fd = open_dev(herd_dev, O_RDONLY);
+
+    getrusage(RUSAGE_THREAD, &ru0);
+    while (fd >= 0 && read(fd, msg, sizeof(msg)) > 0)
+        ;
+    getrusage(RUSAGE_THREAD, &ru1);
+    herd_csw[id] = ru1.ru_nvcsw - ru0.ru_nvcsw;
+    close(fd);
+    return NULL;
+}
+
+static int bench_herd(int argc, char *argv[])
+{
+    static const int readers[] = { 1, 2, 4, 8, 16 };
+    pthread_t tid[HERD_MAX];
+    char msg[REC_LEN];
+    long csw;
+    double t;
+    int out, r, i;
+
+    herd_dev = argc > 0 ? argv[0] : "/dev/scullpipe0";
+    out = open_dev(herd_dev, O_WRONLY);
+    if (out < 0)
+        return 1;
+    if (ioctl(out, SCULL_P_IOCTRECORD, REC_LEN) < 0) {
+        perror("SCULL_P_IOCTRECORD");
+        return 1;
+    }
+    memset(msg, 'h', sizeof(msg));
+    for (r = 0; r < ARRAY_SIZE(readers); r++) {
+        for (i = 0; i < readers[r]; i++)
+            pthread_create(&tid[i], NULL, herd_reader, (void *) (long) i);
+        usleep(100000);     /* let them all go to sleep */
+        t = now();
+        for (i = 0; i < HERD_MSGS; i++)
+            if (write(out, msg, sizeof(msg)) != sizeof(msg))
+                return 1;
+        for (i = 0; i < readers[r]; i++)
+            write(out, msg, 0);
+        for (i = 0, csw = 0; i < readers[r]; i++) {
+            pthread_join(tid[i], NULL);
+            csw += herd_csw[i];
+        }
+        t = now() - t;
+        printf("%2d readers: %9.0f msgs/s, %.2f reader context switches per message\n",
+               readers[r], HERD_MSGS / t, (double) csw / HERD_MSGS);
+    }
+    ioctl(out, SCULL_P_IOCTRECORD, 0);
+    close(out);
+    return 0;
+}
+
+/*
+ * pollat: time poll() on a pipe while it is idle, then while a writer
+ * and a reader stream through it as fast as they can. A poll() that
+ * takes the device lock slows down with the load; a lockless one
+ * should not.
+ */
+#define POLLAT_CALLS    1000000
+
+static volatile int pollat_stop;
+
+static void *pollat_writer(void *arg)
+{
+    static char buf[4096];
+    int fd = open_dev(arg, O_WRONLY | O_NONBLOCK);
+
+    while (fd >= 0 && !pollat_stop)
+        write(fd, buf, sizeof(buf));
+    close(fd);
+    return NULL;
+}
+
+static void *pollat_reader(void *arg)
+{
+    static char buf[4096];
+    int fd = open_dev(arg, O_RDONLY | O_NONBLOCK);
+
+    while (fd >= 0 && !pollat_stop)
+        read(fd, buf, sizeof(buf));
+    close(fd);
+    return NULL;
+}
+
+static double pollat_run(int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN | POLLOUT };
+    double t = now();
+    int i;
+
+    for (i = 0; i < POLLAT_CALLS; i++)
+        poll(&pfd, 1, 0);
+    return (now() - t) / POLLAT_CALLS * 1e9;
+}
+
+static int bench_pollat(int argc, char *argv[])
+{
+    char *name = argc > 0 ? argv[0] : "/dev/scullpipe0";
+    pthread_t wr, rd;
+    int fd = open_dev(name, O_RDONLY | O_NONBLOCK);
+
+    if (fd < 0)
+        return 1;
+    printf("idle: %.0f ns per poll()\n", pollat_run(fd));
+    pthread_create(&wr, NULL, pollat_writer, name);
+    pthread_create(&rd, NULL, pollat_reader, name);
+    usleep(100000);
+    printf("busy: %.0f ns per poll()\n", pollat_run(fd));
+    pollat_stop = 1;
+    pthread_join(wr, NULL);
+    pthread_join(rd, NULL);
+    close(fd);
+    return 0;
+}
+
+/*
+ * bcast: one writer, BCAST_READERS readers, every reader gets the
+ * whole stream. Under SCULL_P_BCAST_BLOCK they all keep up; under
+ * SCULL_P_BCAST_OVERRUN the last reader dawdles and skips data.
+ */
+#define BCAST_READERS   4
+#define BCAST_SIZE      (64 << 20)
+
+struct bcast_reader {
+    const char *name;
+    int slow;
+    long got, skipped, overruns;
+};
+
+static pthread_barrier_t bcast_ready;
+
+static void *bcast_read(void *arg)
+{
+    struct bcast_reader *br = arg;
+    static __thread char buf[65536];
+    int fd = open_dev(br->name, O_RDONLY);
+    ssize_t n;
+
+    pthread_barrier_wait(&bcast_ready);
+    br->got = br->skipped = br->overruns = 0;
+    while (fd >= 0 && br->got + br->skipped < BCAST_SIZE) {
+        n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EOVERFLOW) {
+            br->overruns++;
+            br->skipped += ioctl(fd, SCULL_P_IOCQSKIP);
+            continue;
+        }
+        if (n <= 0)
+            break;
+        br->got += n;
+        if (br->slow)
+            usleep(200);
+    }
+    close(fd);
+    return NULL;
+}
+
+static int bench_bcast(int argc, char *argv[])
+{
+    static const int policies[] = { SCULL_P_BCAST_BLOCK, SCULL_P_BCAST_OVERRUN };
+    struct bcast_reader br[BCAST_READERS];
+    pthread_t tid[BCAST_READERS];
+    static char buf[65536];
+    const char *name = argc > 0 ? argv[0] : "/dev/scullpipe0";
+    int out, p, i;
+    double t, got;
+
+    out = open_dev(name, O_WRONLY);
+    if (out < 0)
+        return 1;
+    for (p = 0; p < ARRAY_SIZE(policies); p++) {
+        if (ioctl(out, SCULL_P_IOCTBCAST, policies[p]) < 0) {
+            perror("SCULL_P_IOCTBCAST");
+            return 1;
+        }
+        pthread_barrier_init(&bcast_ready, NULL, BCAST_READERS + 1);
+        for (i = 0; i < BCAST_READERS; i++) {
+            br[i].name = name;
+            br[i].slow = policies[p] == SCULL_P_BCAST_OVERRUN && i == BCAST_READERS - 1;
+            pthread_create(&tid[i], NULL, bcast_read, &br[i]);
+        }
+        pthread_barrier_wait(&bcast_ready);
+        t = now();
+        for (i = 0; i < BCAST_SIZE; i += sizeof(buf))
+            if (write_all(out, buf, sizeof(buf)) < 0)
+                return 1;
+        for (i = 0; i < BCAST_READERS; i++)
+            pthread_join(tid[i], NULL);
+        t = now() - t;
+        for (i = 0, got = 0; i < BCAST_READERS; i++)
+            got += br[i].got;
+        printf("%s: %.1f MB/s written, %.1f MB/s delivered\n",
+               policies[p] == SCULL_P_BCAST_BLOCK ? "block" : "overrun",
+               BCAST_SIZE / t / (1 << 20), got / t / (1 << 20));
+        for (i = 0; i < BCAST_READERS; i++)
+            printf("  reader %d%s: got %ld bytes, skipped %ld in %ld overruns\n", i,
+                   br[i].slow ? " (slow)" : "", br[i].got, br[i].skipped, br[i].overruns);
+        pthread_barrier_destroy(&bcast_ready);
+        ioctl(out, SCULL_P_IOCTBCAST, 0);
+    }
+    close(out);
+    return 0;
+}
+
+/*
+ * prio: a writer keeps a 1 MB pipe full of bulk records while another
+ * file sends a small timestamped control message every millisecond,
+ * first at priority 0, behind the bulk data, then at priority 1. The
+ * reader drains everything and times the control messages.
+ */
+#define PRIO_RING       (1 << 20)
+#define PRIO_BULK       4000
+#define PRIO_MSGS       1000
+#define PRIO_MAGIC      0x5052494fU
+
+struct prio_msg {
+    unsigned int magic;
+    double sent;
+};
+
+struct prio_run {
+    const char *name;
+    double avg, max;        /* latency of the control messages */
+};
+
+static volatile int prio_stop;
+
+static void *prio_bulk(void *arg)
+{
+    static char buf[PRIO_BULK];
+    int fd = open_dev(arg, O_WRONLY | O_NONBLOCK);
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+
+    while (fd >= 0 && !prio_stop)
+        if (write(fd, buf, sizeof(buf)) < 0)
+            poll(&pfd, 1, 10);
+    close(fd);
+    return NULL;
+}
+
+static void *prio_read(void *arg)
+{
+    static char buf[PRIO_BULK];
+    struct prio_run *run = arg;
+    struct prio_msg m;
+    double sum = 0;
+    ssize_t len;
+    int n = 0, fd = open_dev(run->name, O_RDONLY);
+
+    run->max = 0;
+
+    while (fd >= 0 && n < PRIO_MSGS) {
+        len = read(fd, buf, sizeof(buf));
+        if (len <= 0)
+            break;
+        if (len != sizeof(m))
+            continue;
+        memcpy(&m, buf, sizeof(m));
+        if (m.magic != PRIO_MAGIC)
+            continue;
+        m.sent = now() - m.sent;
+        sum += m.sent;
+        if (m.sent > run->max)
+            run->max = m.sent;
+        n++;
+    }
+    run->avg = n ? sum / n : 0;
+    close(fd);
+    return NULL;
+}
+
+static int bench_prio(int argc, char *argv[])
+{
+    char *name = argc > 0 ? argv[0] : "/dev/scullpipe0";
+    struct prio_msg m = { .magic = PRIO_MAGIC };
+    struct prio_run run = { .name = name };
+    pthread_t bulk, rd;
+    int ctl, prio, i;
+
+    ctl = open_dev(name, O_WRONLY);
+    if (ctl < 0)
+        return 1;
+    if (ioctl(ctl, SCULL_P_IOCTPIPESZ, PRIO_RING) < 0
+            || ioctl(ctl, SCULL_P_IOCTRECORD, PRIO_BULK) < 0) {
+        perror("scullpipe setup");
+        return 1;
+    }
+    for (prio = 0; prio <= 1; prio++) {
+        if (ioctl(ctl, SCULL_P_IOCTPRIO, prio) < 0) {
+            perror("SCULL_P_IOCTPRIO");
+            return 1;
+        }
+        prio_stop = 0;
+        pthread_create(&rd, NULL, prio_read, &run);
+        pthread_create(&bulk, NULL, prio_bulk, name);
+        usleep(100000);     /* let the bulk data fill the pipe */
+        for (i = 0; i < PRIO_MSGS; i++) {
+            m.sent = now();
+            if (write(ctl, &m, sizeof(m)) != sizeof(m)) {
+                perror("write");
+                break;
+            }
+            usleep(1000);
+        }
+        pthread_join(rd, NULL);
+        prio_stop = 1;
+        pthread_join(bulk, NULL);
+        printf("priority %d: control latency avg %.1f us, max %.1f us\n",
+               prio, run.avg * 1e6, run.max * 1e6);
+    }
+    close(ctl);
+    return 0;
+}
+
+/*
+ * busy: a producer sends a timestamp every BUSY_GAP microseconds, so
+ * that the consumer has always just run out of data, and the consumer
+ * notes how late each one arrives: first sleeping in read(), then
+ * busy polling for up to BUSY_POLL microseconds.
+ */
+#define BUSY_MSGS   100000
+#define BUSY_GAP    20
+#define BUSY_POLL   50
+
+static double busy_lat[BUSY_MSGS];
+
+static void *busy_producer(void *arg)
+{
+    int fd = open_dev(arg, O_WRONLY), i;
+    double t;
+
+    for (i = 0; i < BUSY_MSGS && fd >= 0; i++) {
+        t = now() + BUSY_GAP / 1e6;
+        while (now() < t)
+            ;
+        if (write_all(fd, (char *) &t, sizeof(t)) < 0)
+            break;
+    }
+    close(fd);
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int bench_busy(int argc, char *argv[])
+{
+    static const int polls[] = { 0, BUSY_POLL };
+    static const double pct[] = { 50, 90, 99, 99.9 };
+    char *name = argc > 0 ? argv[0] : "/dev/scullpipe0";
+    pthread_t tid;
+    double t;
+    int in, p, i;
+
+    for (p = 0; p < ARRAY_SIZE(polls); p++) {
+        in = open_dev(name, O_RDONLY);
+        if (in < 0)
+            return 1;
+        if (ioctl(in, SCULL_P_IOCTBUSYPOLL, polls[p]) < 0) {
+            perror("SCULL_P_IOCTBUSYPOLL");
+            return 1;
+        }
+        pthread_create(&tid, NULL, busy_producer, name);
+        for (i = 0; i < BUSY_MSGS; i++) {
+            if (read_full(in, &t, sizeof(t)) < 0)
+                return 1;
+            busy_lat[i] = now() - t;
+        }
+        pthread_join(tid, NULL);
+        close(in);
+        qsort(busy_lat, BUSY_MSGS, sizeof(double), cmp_double);
+        printf("busy poll %3d us:", polls[p]);
+        for (i = 0; i < ARRAY_SIZE(pct); i++)
+            printf(" p%g %.1f us", pct[i], busy_lat[(int) (BUSY_MSGS * pct[i] / 100)] * 1e6);
+        printf(", max %.1f us\n", busy_lat[BUSY_MSGS - 1] * 1e6);
+    }
+    return 0;
+}
+
+/*
+ * timeo: a request/response loop over two pipes, where the client
+ * gives up on a response after TIMEO_MS. It either polls for the
+ * response and then reads it, or reads it with a receive timeout set,
+ * which takes one system call instead of two.
+ */
+#define TIMEO_MS    5
+
+static int bench_timeo(int argc, char *argv[])
+{
+    struct pipe_args pa = {
+        argc > 0 ? argv[0] : "/dev/scullpipe0",
+        argc > 1 ? argv[1] : "/dev/scullpipe1",
+        PIPE_PINGS
+    };
+    struct pollfd pfd = { .events = POLLIN };
+    pthread_t tid;
+    int out, in, mode;
+    long msg, timeouts;
+    double t;
+
+    for (mode = 0; mode < 2; mode++) {
+        pthread_create(&tid, NULL, pipe_echo, &pa);
+        out = open_dev(pa.p0, O_WRONLY);
+        in = open_dev(pa.p1, O_RDONLY);
+        if (out < 0 || in < 0)
+            return 1;
+        if (mode && ioctl(in, SCULL_P_IOCTRCVTIMEO, TIMEO_MS) < 0) {
+            perror("SCULL_P_IOCTRCVTIMEO");
+            return 1;
+        }
+        pfd.fd = in;
+        timeouts = 0;
+        t = now();
+        for (msg = 0; msg < PIPE_PINGS; msg++) {
+            if (write_all(out, (char *) &msg, sizeof(msg)) < 0)
+                return 1;
+            if (!mode && poll(&pfd, 1, TIMEO_MS) == 0) {
+                timeouts++;
+                continue;
+            }
+            if (read(in, &msg, sizeof(msg)) < 0) {
+                if (errno != ETIMEDOUT)
+                    return 1;
+                timeouts++;
+            }
+        }
+        t = now() - t;
+        pthread_join(tid, NULL);
+        close(in);
+        close(out);
+        printf("%s: %.2f us per request, %ld timeouts\n",
+               mode ? "read() with SCULL_P_IOCTRCVTIMEO" : "poll() + read()",
+               t / PIPE_PINGS * 1e6, timeouts);
+    }
+    return 0;
+}
+
+/*
+ * reopen: open the pipe, pass a message through it and close it again,
+ * as a client that reconnects for every request does; first with the
+ * buffer going back to the pool on every close, then with the device
+ * persistent. Last, check that data written before a close can be read
+ * after the next open.
+ */
+#define REOPEN_COUNT    100000
+
+static int bench_reopen(int argc, char *argv[])
+{
+    const char *name = argc > 0 ? argv[0] : "/dev/scullpipe0";
+    char msg[64] = "reopen", back[64];
+    int fd, persist, i;
+    double t;
+
+    for (persist = 0; persist <= 1; persist++) {
+        fd = open_dev(name, O_RDWR);
+        if (fd < 0 || ioctl(fd, SCULL_P_IOCTPERSIST, persist) < 0) {
+            perror("SCULL_P_IOCTPERSIST");
+            return 1;
+        }
+        close(fd);
+        t = now();
+        for (i = 0; i < REOPEN_COUNT; i++) {
+            fd = open(name, O_RDWR | O_NONBLOCK);
+            if (fd < 0
+                    || write(fd, msg, sizeof(msg)) != sizeof(msg)
+                    || read(fd, back, sizeof(back)) != sizeof(back)) {
+                perror(name);
+                return 1;
+            }
+            close(fd);
+        }
+        t = now() - t;
+        printf("%s: %.0f open/close per second\n",
+               persist ? "persistent" : "pooled", REOPEN_COUNT / t);
+    }
+
+    /* the device is still persistent */
+    fd = open_dev(name, O_WRONLY);
+    if (fd < 0 || write(fd, msg, sizeof(msg)) != sizeof(msg))
+        return 1;
+    close(fd);
+    fd = open_dev(name, O_RDONLY | O_NONBLOCK);
+    if (fd < 0)
+        return 1;
+    printf("data kept across close: %s\n",
+           read(fd, back, sizeof(back)) == sizeof(back)
+           && strcmp(back, msg) == 0 ? "yes" : "no");
+    ioctl(fd, SCULL_P_IOCTPERSIST, 0);
+    close(fd);
+    return 0;
+}
+
+/*
+ * mirror: stream MIRROR_TOTAL bytes through a MIRROR_RING pipe in
+ * MIRROR_CHUNK writes and reads, first with the ring used a page at a
+ * time, then mirrored, then with the reader working straight from an
+ * mmap() of the mirror. The first needs root, to change the
+ * scull_p_mirror_min parameter; the ring is resized to apply it.
+ */
+#define MIRROR_RING     (4 << 20)
+#define MIRROR_CHUNK    (1 << 20)
+#define MIRROR_TOTAL    (1L << 30)
+#define MIRROR_PARAM    "/sys/module/scull/parameters/scull_p_mirror_min"
+
+static void *mirror_writer(void *arg)
+{
+    static char buf[MIRROR_CHUNK];
+    int fd = open_dev(arg, O_WRONLY);
+    long i;
+
+    for (i = 0; fd >= 0 && i < MIRROR_TOTAL; i += sizeof(buf))
+        if (write_all(fd, buf, sizeof(buf)) < 0)
+            break;
+    close(fd);
+    return NULL;
+}
+
+static int mirror_param(const char *val)
+{
+    int fd = open(MIRROR_PARAM, O_WRONLY), ok;
+
+    if (fd < 0)
+        return -1;
+    ok = write(fd, val, strlen(val)) > 0;
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+static long mirror_read(int fd)
+{
+    static char buf[MIRROR_CHUNK];
+    long total = 0;
+    ssize_t n;
+
+    while (total < MIRROR_TOTAL && (n = read(fd, buf, sizeof(buf))) > 0)
+        total += n;
+    return total;
+}
+
+static volatile unsigned long mirror_sink;
+
+/* Read from the mapping: sum a word per cache line, then free it all */
+static long mirror_mmap(int fd, char *map)
+{
+    struct scull_p_mmap mm;
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    unsigned long sum = 0, off, n;
+    long total = 0;
+
+    while (total < MIRROR_TOTAL) {
+        if (ioctl(fd, SCULL_P_IOCGMMAP, &mm) < 0)
+            return -1;
+        n = mm.head - mm.tail;
+        if (!n) {
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        for (off = 0; off < n; off += 64)
+            sum += *(unsigned long *) (map + (mm.tail & (mm.size - 1)) + off);
+        if (ioctl(fd, SCULL_P_IOCTCONSUME, n) < 0)
+            return -1;
+        total += n;
+    }
+    mirror_sink = sum;
+    return total;
+}
+
+static int bench_mirror(int argc, char *argv[])
+{
+    static const char *modes[] = { "paged read()", "mirrored read()", "mirrored mmap()" };
+    char *name = argc > 0 ? argv[0] : "/dev/scullpipe0";
+    char *map = NULL;
+    pthread_t tid;
+    long total;
+    double t;
+    int fd, m;
+
+    fd = open_dev(name, O_RDONLY);
+    if (fd < 0)
+        return 1;
+    for (m = 0; m < ARRAY_SIZE(modes); m++) {
+        if (m == 0 && mirror_param("2147483647") < 0) {
+            printf("%s: skipped, can't write %s\n", modes[m], MIRROR_PARAM);
+            continue;
+        }
+        if (m == 1)
+            mirror_param("1048576");
+        if (m < 2 && ioctl(fd, SCULL_P_IOCTPIPESZ, MIRROR_RING) < 0) {
+            perror("SCULL_P_IOCTPIPESZ");
+            return 1;
+        }
+        if (m == 2) {
+            map = mmap(NULL, 2 * MIRROR_RING, PROT_READ, MAP_SHARED, fd, 0);
+            if (map == MAP_FAILED) {
+                perror("mmap");
+                return 1;
+            }
+        }
+        pthread_create(&tid, NULL, mirror_writer, name);
+        t = now();
+        total = m == 2 ? mirror_mmap(fd, map) : mirror_read(fd);
+        t = now() - t;
+        pthread_join(tid, NULL);
+        printf("%s: %.1f MB/s\n", modes[m], total / t / (1 << 20));
+    }
+    if (map)
+        munmap(map, 2 * MIRROR_RING);
+    close(fd);
+    return 0;
+}
+
+/*
+ * lat: a writer streams LAT_WRITES writes of 4KB through a pipe with
+ * latency stamps on, to a reader that takes a nap every so often, and
+ * the histogram the driver kept is printed, with the writers' sleeps.
+ */
+#define LAT_WRITES  100000
+
+static void *lat_writer(void *arg)
+{
+    static char buf[4096];
+    int fd = open_dev(arg, O_WRONLY), i;
+
+    for (i = 0; fd >= 0 && i < LAT_WRITES; i++)
+        if (write_all(fd, buf, sizeof(buf)) < 0)
+            break;
+    close(fd);
+    return NULL;
+}
+
+static int bench_lat(int argc, char *argv[])
+{
+    char *name = argc > 0 ? argv[0] : "/dev/scullpipe0";
+    static char buf[4096];
+    struct scull_p_lat lat;
+    unsigned long total = 0;
+    pthread_t tid;
+    size_t got = 0;
+    ssize_t n;
+    int fd, i, reads = 0;
+
+    fd = open_dev(name, O_RDONLY);
+    if (fd < 0)
+        return 1;
+    if (ioctl(fd, SCULL_P_IOCTSTAMP, 1) < 0) {
+        perror("SCULL_P_IOCTSTAMP");
+        return 1;
+    }
+    pthread_create(&tid, NULL, lat_writer, name);
+    while (got < (size_t) LAT_WRITES * sizeof(buf) && (n = read(fd, buf, sizeof(buf))) > 0) {
+        got += n;
+        if (++reads % 1000 == 0)
+            usleep(1000);
+    }
+    pthread_join(tid, NULL);
+    if (ioctl(fd, SCULL_P_IOCGLAT, &lat) < 0) {
+        perror("SCULL_P_IOCGLAT");
+        return 1;
+    }
+    ioctl(fd, SCULL_P_IOCTSTAMP, 0);
+    close(fd);
+
+    for (i = 0; i < SCULL_P_LAT_BUCKETS; i++)
+        total += lat.hist[i];
+    printf("%lu writes timed, %lu unstamped\n", total, lat.dropped);
+    for (i = 0; i < SCULL_P_LAT_BUCKETS; i++)
+        if (lat.hist[i])
+            printf("  %10.1f us and up: %8lu (%.1f%%)\n", (1UL << i) / 1e3,
+                   lat.hist[i], 100.0 * lat.hist[i] / total);
+    printf("writers blocked %lu times, %.1f ms in all\n",
+           lat.blocked, lat.blocked_ns / 1e6);
+    return 0;
+}
+
+static struct {
+    const char *name;
+    int (*run)(int argc, char *argv[]);
+} benches[] = {
+    { "kv", bench_kv },
+    { "seal", bench_seal },
+    { "copy", bench_copy },
+    { "numa", bench_numa },
+    { "extent", bench_extent },
+    { "compact", bench_compact },
+    { "dmabuf", bench_dmabuf },
+    { "hint", bench_hint },
+    { "pipe", bench_pipe },
+    { "record", bench_record },
+    { "splice", bench_splice },
+    { "pipesz", bench_pipesz },
+    { "lowat", bench_lowat },
+    { "herd", bench_herd },
+    { "pollat", bench_pollat },
+    { "bcast", bench_bcast },
+    { "prio", bench_prio },
+    { "busy", bench_busy },
+    { "timeo", bench_timeo },
+    { "reopen", bench_reopen },
+    { "mirror", bench_mirror },
+    { "lat", bench_lat },
+};
+
+int main(int argc, char *argv[])
+{
+    int i;
+
+    for (i = 0; argc > 1 && i < ARRAY_SIZE(benches); i++)
+        if (strcmp(argv[1], benches[i].name) == 0)
+            return benches[i].run(argc - 2, argv + 2);
+
+    printf("usage: ./scull_bench");
+    for (i = 0; i < ARRAY_SIZE(benches); i++)
+        printf("%s%s", i ? "|" : " ", benches[i].name);
+    printf(" [args]\n");
+    return 1;
+}
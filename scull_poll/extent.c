@@ -0,0 +1,225 @@
+/*
+ * extent.c -- extent storage for large sequential writes
+ *
+ * A stream written at the end of the device would otherwise turn into
+ * one 4000-byte kmalloc per quantum and a long qset chain. In extent
+ * mode such appends get variable-size extents instead: high-order page
+ * blocks (vmalloc when those can't be had), doubling in size as the
+ * stream goes on. Extents live in an interval tree keyed by the device
+ * offsets they back; anything they don't cover still uses quanta.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>	/* printk(), min() */
+#include <linux/slab.h>		/* kmalloc() */
+#include <linux/vmalloc.h>
+#include <linux/gfp.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/fs.h>		/* everything... */
+#include <linux/errno.h>	/* error codes */
+#include <linux/types.h>	/* size_t */
+#include <linux/cdev.h>
+#include <linux/interval_tree_generic.h>
+
+#include "scull.h"		/* local definitions */
+
+struct scull_extent {
+    struct rb_node rb;
+    unsigned long start, last;  /* device offsets backed, inclusive */
+    unsigned long subtree_last; /* for the interval tree */
+    char *data;
+    int order;                  /* page order, or -1 if vmalloc()ed */
+};
+
+#define EXT_START(ext) ((ext)->start)
+#define EXT_LAST(ext)  ((ext)->last)
+
+INTERVAL_TREE_DEFINE(struct scull_extent, rb, unsigned long, subtree_last,
+                     EXT_START, EXT_LAST, static, scull_extent_tree)
+
+/*
+ * Get "size" bytes of contiguous kernel memory near the device's NUMA
+ * node: a high-order page block if the buddy allocator has one handy,
+ * vmalloc otherwise. Either way it is a single allocation, and zeroed:
+ * the part not yet written may be read, mapped or exported.
+ */
+static struct scull_extent *scull_extent_alloc(struct scull_dev *dev, size_t size)
+{
+    struct scull_extent *ext;
+    struct page *page;
+    int node = scull_alloc_node(dev);
+
+    ext = kmalloc(sizeof(struct scull_extent), GFP_KERNEL);
+    if (!ext)
+        return NULL;
+    ext->order = get_order(size);
+    page = alloc_pages_node(node, GFP_KERNEL | __GFP_COMP | __GFP_ZERO
+                            | __GFP_NOWARN | __GFP_NORETRY, ext->order);
+    if (page) {
+        ext->data = page_address(page);
+    } else {
+        ext->order = -1;
+        ext->data = vzalloc_node(size, node);
+    }
+    if (!ext->data) {
+        kfree(ext);
+        return NULL;
+    }
+    return ext;
+}
+
+static void scull_extent_free(struct scull_extent *ext)
+{
+    if (ext->order < 0)
+        vfree(ext->data);
+    else
+        free_pages((unsigned long) ext->data, ext->order);
+    kfree(ext);
+}
+
+/*
+ * Called for appends at "pos" on an extent-mode device: start a new
+ * extent if this is a big write, or a stream that just filled the
+ * previous extent. Small writes are left to the quanta. Failing to
+ * get the memory is not an error, the quanta take over.
+ */
+void scull_extent_grow(struct scull_dev *dev, loff_t pos, size_t count)
+{
+    struct scull_extent *next;
+    size_t size;
+
+    if (!count || scull_extent_tree_iter_first(&dev->extents, pos, pos))
+        return;     /* nothing to do, or already backed */
+    if (count < dev->quantum && (pos == 0
+            || !scull_extent_tree_iter_first(&dev->extents, pos - 1, pos - 1)))
+        return;
+
+    size = max3((size_t) SCULL_EXTENT_MIN, (size_t) dev->extent_next,
+                (size_t) roundup_pow_of_two(count));
+    size = min_t(size_t, size, SCULL_EXTENT_MAX);
+    next = scull_extent_tree_iter_first(&dev->extents, pos, pos + size - 1);
+    if (next)
+        size = next->start - pos;   /* don't overlap the next one */
+
+    if (scull_extent_add(dev, pos, size))
+        dev->extent_next = min_t(size_t, size * 2, SCULL_EXTENT_MAX);
+}
+
+/*
+ * Back [pos, pos + size) with a new extent and return its memory, or
+ * NULL if there is none to be had. The caller makes sure the range
+ * doesn't overlap an existing extent.
+ */
+char *scull_extent_add(struct scull_dev *dev, loff_t pos, size_t size)
+{
+    struct scull_extent *ext;
+
+    ext = scull_extent_alloc(dev, size);
+    if (!ext)
+        return NULL;
+    ext->start = pos;
+    ext->last = pos + size - 1;
+    scull_extent_tree_insert(ext, &dev->extents);
+    dev->allocs++;
+    return ext->data;
+}
+
+/*
+ * If an extent backs "pos", return the address of that byte and cut
+ * *len down to the end of the extent. Otherwise return NULL, after
+ * cutting *len down so that it stops short of the next extent.
+ */
+char *scull_extent_locate(struct scull_dev *dev, loff_t pos, size_t *len)
+{
+    struct scull_extent *ext;
+
+    if (RB_EMPTY_ROOT(&dev->extents.rb_root))
+        return NULL;
+    ext = scull_extent_tree_iter_first(&dev->extents, pos,
+                                       pos + max_t(size_t, *len, 1) - 1);
+    if (!ext)
+        return NULL;
+    if (ext->start > pos) {
+        *len = ext->start - pos;
+        return NULL;
+    }
+    *len = min_t(size_t, *len, ext->last + 1 - pos);
+    return ext->data + (pos - ext->start);
+}
+
+/* Count the extents and their bytes */
+void scull_extent_stat(struct scull_dev *dev, struct scull_stat *st)
+{
+    struct scull_extent *ext;
+
+    for (ext = scull_extent_tree_iter_first(&dev->extents, 0, ULONG_MAX);
+         ext; ext = scull_extent_tree_iter_next(ext, 0, ULONG_MAX)) {
+        st->extents++;
+        st->extent_bytes += ext->last - ext->start + 1;
+    }
+}
+
+/*
+ * Count extent pages per NUMA node. A page block sits on one node; a
+ * vmalloc()ed extent may be spread over several, so go page by page.
+ */
+void scull_extent_numa_stat(struct scull_dev *dev, struct scull_numa_stat *st)
+{
+    struct scull_extent *ext;
+    unsigned long off, size;
+    int nid;
+
+    for (ext = scull_extent_tree_iter_first(&dev->extents, 0, ULONG_MAX);
+         ext; ext = scull_extent_tree_iter_next(ext, 0, ULONG_MAX)) {
+        if (ext->order >= 0) {
+            nid = page_to_nid(virt_to_page(ext->data));
+            st->extent_pages[min(nid, SCULL_NUMA_NODES - 1)] += 1UL << ext->order;
+            continue;
+        }
+        size = PAGE_ALIGN(ext->last - ext->start + 1);
+        for (off = 0; off < size; off += PAGE_SIZE) {
+            nid = page_to_nid(vmalloc_to_page(ext->data + off));
+            st->extent_pages[min(nid, SCULL_NUMA_NODES - 1)]++;
+        }
+    }
+}
+
+/* Extent bytes that lie beyond the end of the data */
+unsigned long scull_extent_slack(struct scull_dev *dev)
+{
+    struct scull_extent *ext;
+    unsigned long slack = 0;
+
+    for (ext = scull_extent_tree_iter_first(&dev->extents, dev->size, ULONG_MAX);
+         ext; ext = scull_extent_tree_iter_next(ext, dev->size, ULONG_MAX))
+        slack += ext->last + 1 - max(ext->start, dev->size);
+    return slack;
+}
+
+/* Free the extents that start at or beyond "len" */
+void scull_extent_truncate(struct scull_dev *dev, loff_t len)
+{
+    struct scull_extent *ext;
+
+    while ((ext = scull_extent_tree_iter_first(&dev->extents, len, ULONG_MAX))) {
+        if (ext->start < len)
+            ext = scull_extent_tree_iter_next(ext, len, ULONG_MAX);
+        if (!ext)
+            break;
+        scull_extent_tree_remove(ext, &dev->extents);
+        scull_extent_free(ext);
+    }
+}
+
+/* Free all extents; called by scull_trim() */
+void scull_extent_trim(struct scull_dev *dev)
+{
+    struct scull_extent *ext;
+
+    while ((ext = scull_extent_tree_iter_first(&dev->extents, 0, ULONG_MAX))) {
+        scull_extent_tree_remove(ext, &dev->extents);
+        scull_extent_free(ext);
+    }
+    dev->extent_next = 0;
+}
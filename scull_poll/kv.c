@@ -0,0 +1,484 @@
+/*
+ * kv.c -- key-value store on top of the scull quanta
+ *
+ * A PUT appends a record to the device, exactly as if it had been
+ * written there, and indexes it in a resizable hash table (rhashtable),
+ * so chains stay short however many keys there are. Updates and deletes
+ * only touch the index, so the records themselves never change once
+ * written: readers look keys up under SRCU instead of the device
+ * mutex, and may sleep in copy_to_user() while doing so.
+ *
+ * The records left behind by updates and deletes are dead weight. Once
+ * they outweigh the live ones, the live records are copied to fresh
+ * quanta and the old quanta are freed after a grace period, so a store
+ * that keeps updating a few keys stays small.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>	/* printk() */
+#include <linux/slab.h>		/* kmalloc() */
+#include <linux/fs.h>		/* everything... */
+#include <linux/errno.h>	/* error codes */
+#include <linux/types.h>	/* size_t */
+#include <linux/cdev.h>
+#include <linux/list.h>
+#include <linux/rhashtable.h>
+#include <linux/jhash.h>
+#include <linux/srcu.h>
+#include <asm/uaccess.h>
+
+#include "scull.h"		/* local definitions */
+
+#define SCULL_KV_DEAD_MIN 4     /* quanta of dead records worth compacting */
+
+struct scull_kv {
+    struct rhashtable ht;
+    struct list_head entries;   /* every indexed key */
+    struct srcu_struct srcu;    /* protects lookups and the quanta */
+    unsigned long nkeys;
+    size_t live, dead;          /* bytes of indexed and of superseded records */
+};
+
+/*
+ * The record as stored in a quantum: header, key, value.
+ */
+struct scull_kv_rec {
+    u32 klen;
+    u32 vlen;
+    char data[];
+};
+
+struct scull_kv_entry {
+    struct rhash_head node;
+    struct list_head list;
+    struct rcu_head rcu;
+    u32 hash;                   /* of the key, seed 0 */
+    struct scull_kv_rec *rec;   /* points into a quantum */
+    struct scull_kv_rec *moved; /* its copy, while compacting */
+};
+
+/* What a lookup hashes and compares */
+struct scull_kv_key {
+    const char *data;
+    u32 len;
+    u32 hash;
+};
+
+/*
+ * The table rehashes with a new seed when it resizes. Both sides mix
+ * the seed into the key's own hash, so the resize worker never reads
+ * a record, which may be freed under it.
+ */
+static u32 scull_kv_hashfn(const void *data, u32 len, u32 seed)
+{
+    const struct scull_kv_key *key = data;
+
+    return jhash_1word(key->hash, seed);
+}
+
+static u32 scull_kv_obj_hashfn(const void *data, u32 len, u32 seed)
+{
+    const struct scull_kv_entry *e = data;
+
+    return jhash_1word(e->hash, seed);
+}
+
+static int scull_kv_cmpfn(struct rhashtable_compare_arg *arg, const void *obj)
+{
+    const struct scull_kv_key *key = arg->key;
+    const struct scull_kv_entry *e = obj;
+    const struct scull_kv_rec *rec = smp_load_acquire(&e->rec);
+
+    return e->hash != key->hash || rec->klen != key->len
+        || memcmp(rec->data, key->data, key->len);
+}
+
+static const struct rhashtable_params scull_kv_params = {
+    .head_offset = offsetof(struct scull_kv_entry, node),
+    .hashfn = scull_kv_hashfn,
+    .obj_hashfn = scull_kv_obj_hashfn,
+    .obj_cmpfn = scull_kv_cmpfn,
+    .automatic_shrinking = true,
+};
+
+static void scull_kv_free(struct rcu_head *head)
+{
+    kfree(container_of(head, struct scull_kv_entry, rcu));
+}
+
+/* Find a key; called under srcu_read_lock() or the device mutex */
+static struct scull_kv_entry *scull_kv_lookup(struct scull_kv *kv,
+        const char *data, u32 len)
+{
+    struct scull_kv_key key = { data, len, jhash(data, len, 0) };
+
+    return rhashtable_lookup_fast(&kv->ht, &key, scull_kv_params);
+}
+
+static size_t scull_kv_reclen(const struct scull_kv_rec *rec)
+{
+    return sizeof(*rec) + rec->klen + rec->vlen;
+}
+
+/*
+ * Make room for a record of "reclen" bytes at the end of the device.
+ * Records are 8-byte aligned and never cross a quantum, so a lookup
+ * only needs the record's address. Returns NULL if there is no memory;
+ * otherwise *end is where the device ends once the record is filled in.
+ */
+static struct scull_kv_rec *scull_kv_room(struct scull_dev *dev,
+        size_t reclen, unsigned long *end)
+{
+    unsigned long pos = dev->size - dev->size % dev->quantum;
+    int q_pos = ALIGN(dev->size % dev->quantum, 8);
+    char *qptr;
+
+    if (q_pos + reclen > dev->quantum) {
+        pos += dev->quantum;
+        q_pos = 0;
+    }
+    qptr = scull_get_quantum(dev, pos);
+    if (!qptr)
+        return NULL;
+    *end = pos + q_pos + reclen;
+    return (struct scull_kv_rec *) (qptr + q_pos);
+}
+
+/*
+ * Copy the live records to fresh quanta, back to back, and free the
+ * old ones once no reader can be looking at them. Called with the
+ * device mutex held; if memory runs out, nothing changes.
+ */
+static void scull_kv_compact(struct scull_dev *dev)
+{
+    struct scull_kv *kv = dev->kv;
+    struct scull_qset *old = dev->data;
+    unsigned long size = dev->size, allocs = dev->allocs, end;
+    struct scull_kv_entry *e;
+    size_t reclen;
+
+    dev->data = NULL;
+    dev->size = 0;
+    dev->allocs = 0;
+    list_for_each_entry(e, &kv->entries, list) {
+        reclen = scull_kv_reclen(e->rec);
+        e->moved = scull_kv_room(dev, reclen, &end);
+        if (!e->moved) {
+            scull_free_qsets(dev->data, dev->qset);
+            dev->data = old;
+            dev->size = size;
+            dev->allocs = allocs;
+            return;
+        }
+        memcpy(e->moved, e->rec, reclen);
+        dev->size = end;
+    }
+    /* pairs with smp_load_acquire() in the lookups */
+    list_for_each_entry(e, &kv->entries, list)
+        smp_store_release(&e->rec, e->moved);
+    synchronize_srcu(&kv->srcu);
+    scull_free_qsets(old, dev->qset);
+    kv->dead = 0;
+}
+
+/* Compact once the dead records outweigh the live ones */
+static void scull_kv_reclaim(struct scull_dev *dev)
+{
+    struct scull_kv *kv = dev->kv;
+
+    if (kv->dead > kv->live && kv->dead >= SCULL_KV_DEAD_MIN * dev->quantum)
+        scull_kv_compact(dev);
+}
+
+/* Append a record to the device and point the index at it */
+static int scull_kv_put(struct scull_dev *dev, struct scull_kv_op *op)
+{
+    struct scull_kv *kv = dev->kv;
+    struct scull_kv_entry *e, *old;
+    struct scull_kv_rec *rec;
+    unsigned long end;
+    size_t reclen;
+    int err;
+
+    if (!op->klen || op->klen > SCULL_KV_KEY_MAX)
+        return -EINVAL;
+    e = kmalloc(sizeof(*e), GFP_KERNEL);
+    if (!e)
+        return -ENOMEM;
+    if (mutex_lock_interruptible(&dev->mutex)) {
+        kfree(e);
+        return -ERESTARTSYS;
+    }
+
+    err = -EPERM;
+    if (dev->sealed)
+        goto fail;
+    err = -EMSGSIZE;
+    if (op->vlen > dev->quantum)
+        goto fail;
+    reclen = sizeof(*rec) + op->klen + op->vlen;
+    if (reclen > dev->quantum)
+        goto fail;
+
+    err = -ENOMEM;
+    rec = scull_kv_room(dev, reclen, &end);
+    if (!rec)
+        goto fail;
+
+    err = -EFAULT;
+    if (copy_from_user(rec->data, (void __user *) op->key, op->klen))
+        goto fail;
+    if (copy_from_user(rec->data + op->klen, (void __user *) op->val,
+                op->vlen))
+        goto fail;
+    rec->klen = op->klen;
+    rec->vlen = op->vlen;
+
+    /* the record is complete: publish it */
+    e->rec = rec;
+    e->hash = jhash(rec->data, rec->klen, 0);
+    old = scull_kv_lookup(kv, rec->data, rec->klen);
+    if (old) {
+        err = rhashtable_replace_fast(&kv->ht, &old->node, &e->node,
+                                      scull_kv_params);
+        if (err)
+            goto fail;
+        list_replace(&old->list, &e->list);
+        kv->live -= scull_kv_reclen(old->rec);
+        kv->dead += scull_kv_reclen(old->rec);
+        call_srcu(&kv->srcu, &old->rcu, scull_kv_free);
+    } else {
+        err = rhashtable_insert_fast(&kv->ht, &e->node, scull_kv_params);
+        if (err)
+            goto fail;
+        list_add(&e->list, &kv->entries);
+        kv->nkeys++;
+    }
+    kv->live += reclen;
+    dev->size = end;
+    scull_kv_reclaim(dev);
+    mutex_unlock(&dev->mutex);
+    return 0;
+
+fail:
+    mutex_unlock(&dev->mutex);
+    kfree(e);
+    return err;
+}
+
+static int scull_kv_del(struct scull_dev *dev, struct scull_kv_op *op)
+{
+    struct scull_kv *kv = dev->kv;
+    struct scull_kv_entry *e;
+    char key[SCULL_KV_KEY_MAX];
+
+    if (!op->klen || op->klen > SCULL_KV_KEY_MAX)
+        return -EINVAL;
+    if (copy_from_user(key, (void __user *) op->key, op->klen))
+        return -EFAULT;
+
+    if (mutex_lock_interruptible(&dev->mutex))
+        return -ERESTARTSYS;
+    if (dev->sealed) {
+        mutex_unlock(&dev->mutex);
+        return -EPERM;
+    }
+    e = scull_kv_lookup(kv, key, op->klen);
+    if (e) {
+        rhashtable_remove_fast(&kv->ht, &e->node, scull_kv_params);
+        list_del(&e->list);
+        kv->live -= scull_kv_reclen(e->rec);
+        kv->dead += scull_kv_reclen(e->rec);
+        call_srcu(&kv->srcu, &e->rcu, scull_kv_free);
+        kv->nkeys--;
+        scull_kv_reclaim(dev);
+    }
+    mutex_unlock(&dev->mutex);
+    return e ? 0 : -ENOENT;
+}
+
+/*
+ * Lockless lookup. The value is copied straight from its quantum to
+ * user space; op->vlen is set to the value size even on -EMSGSIZE.
+ */
+static int scull_kv_get(struct scull_kv *kv, struct scull_kv_op *op)
+{
+    struct scull_kv_entry *e;
+    struct scull_kv_rec *rec;
+    char key[SCULL_KV_KEY_MAX];
+    int idx, err = 0;
+
+    if (!op->klen || op->klen > SCULL_KV_KEY_MAX)
+        return -EINVAL;
+    if (copy_from_user(key, (void __user *) op->key, op->klen))
+        return -EFAULT;
+
+    idx = srcu_read_lock(&kv->srcu);
+    e = scull_kv_lookup(kv, key, op->klen);
+    if (!e) {
+        err = -ENOENT;
+    } else {
+        rec = smp_load_acquire(&e->rec);   /* compaction may move it */
+        if (rec->vlen > op->vlen)
+            err = -EMSGSIZE;
+        else if (copy_to_user((void __user *) op->val,
+                    rec->data + rec->klen, rec->vlen))
+            err = -EFAULT;
+        op->vlen = rec->vlen;
+    }
+    srcu_read_unlock(&kv->srcu, idx);
+    return err;
+}
+
+/*
+ * Look up a batch of keys in one call; returns how many were found.
+ * Every op gets its own status and value size.
+ */
+static long scull_kv_mget(struct scull_kv *kv, struct scull_kv_mget *mg)
+{
+    struct scull_kv_op __user *uop = (struct scull_kv_op __user *) mg->ops;
+    struct scull_kv_op op;
+    unsigned int i;
+    long found = 0;
+
+    for (i = 0; i < mg->nops; i++, uop++) {
+        if (copy_from_user(&op, uop, sizeof(op)))
+            return -EFAULT;
+        op.status = scull_kv_get(kv, &op);
+        if (op.status == -EFAULT)
+            return -EFAULT;
+        if (op.status == 0)
+            found++;
+        if (copy_to_user(uop, &op, sizeof(op)))
+            return -EFAULT;
+    }
+    return found;
+}
+
+long scull_kv_ioctl(struct scull_dev *dev, unsigned int cmd, unsigned long arg)
+{
+    struct scull_kv_op __user *uop = (struct scull_kv_op __user *) arg;
+    struct scull_kv_mget mg;
+    struct scull_kv_op op;
+    int retval;
+
+    /* pairs with smp_store_release() in scull_kv_enable() */
+    if (!smp_load_acquire(&dev->kv_mode))
+        return -EINVAL;
+
+    switch(cmd) {
+        case SCULL_IOCKVPUT:
+            if (copy_from_user(&op, uop, sizeof(op)))
+                return -EFAULT;
+            return scull_kv_put(dev, &op);
+
+        case SCULL_IOCKVDEL:
+            if (copy_from_user(&op, uop, sizeof(op)))
+                return -EFAULT;
+            return scull_kv_del(dev, &op);
+
+        case SCULL_IOCKVGET:
+            if (copy_from_user(&op, uop, sizeof(op)))
+                return -EFAULT;
+            retval = scull_kv_get(dev->kv, &op);
+            if ((retval == 0 || retval == -EMSGSIZE)
+                    && __put_user(op.vlen, &uop->vlen))
+                return -EFAULT;
+            return retval;
+
+        case SCULL_IOCKVMGET:
+            if (copy_from_user(&mg, (void __user *) arg, sizeof(mg)))
+                return -EFAULT;
+            return scull_kv_mget(dev->kv, &mg);
+    }
+    return -ENOTTY;
+}
+
+/*
+ * Turn kv mode on or off; either way the device is emptied. The index
+ * is allocated the first time and kept until the module goes away, so
+ * a lockless reader never sees it freed.
+ */
+int scull_kv_enable(struct scull_dev *dev, int on)
+{
+    struct scull_kv *kv;
+    int err = 0;
+
+    if (mutex_lock_interruptible(&dev->mutex))
+        return -ERESTARTSYS;
+    if (dev->sealed) {
+        err = -EPERM;
+        goto out;
+    }
+    if (dev->ring_quanta || dev->exports) {
+        err = -EBUSY;
+        goto out;
+    }
+    if (on && !dev->kv) {
+        kv = kmalloc(sizeof(struct scull_kv), GFP_KERNEL);
+        if (!kv) {
+            err = -ENOMEM;
+            goto out;
+        }
+        memset(kv, 0, sizeof(struct scull_kv));
+        INIT_LIST_HEAD(&kv->entries);
+        err = rhashtable_init(&kv->ht, &scull_kv_params);
+        if (err) {
+            kfree(kv);
+            goto out;
+        }
+        err = init_srcu_struct(&kv->srcu);
+        if (err) {
+            rhashtable_destroy(&kv->ht);
+            kfree(kv);
+            goto out;
+        }
+        dev->kv = kv;
+    }
+    scull_trim(dev);
+    smp_store_release(&dev->kv_mode, on ? 1 : 0);
+
+out:
+    mutex_unlock(&dev->mutex);
+    return err;
+}
+
+/*
+ * Drop every key; called by scull_trim() before it frees the quanta
+ * the records live in, so it waits for the readers to go away.
+ */
+void scull_kv_clear(struct scull_dev *dev)
+{
+    struct scull_kv *kv = dev->kv;
+    struct scull_kv_entry *e, *tmp;
+
+    if (!kv)
+        return;
+    list_for_each_entry_safe(e, tmp, &kv->entries, list) {
+        rhashtable_remove_fast(&kv->ht, &e->node, scull_kv_params);
+        list_del(&e->list);
+        call_srcu(&kv->srcu, &e->rcu, scull_kv_free);
+    }
+    kv->nkeys = 0;
+    kv->live = kv->dead = 0;
+    synchronize_srcu(&kv->srcu);
+}
+
+unsigned long scull_kv_nkeys(struct scull_dev *dev)
+{
+    return dev->kv ? dev->kv->nkeys : 0;
+}
+
+/* Release the index at module unload; the device is already trimmed */
+void scull_kv_cleanup(struct scull_dev *dev)
+{
+    struct scull_kv *kv = dev->kv;
+
+    if (!kv)
+        return;
+    srcu_barrier(&kv->srcu);
+    cleanup_srcu_struct(&kv->srcu);
+    rhashtable_destroy(&kv->ht);
+    kfree(kv);
+    dev->kv = NULL;
+}
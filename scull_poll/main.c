@@ -11,6 +11,11 @@
 #include <linux/seq_file.h>
 
 #include <linux/capability.h>
+#include <linux/file.h>
+#include <linux/nodemask.h>
+#include <linux/mm.h>
+#include <linux/workqueue.h>
+#include <linux/prefetch.h>
 #include "scull.h"
 
 /*
@@ -28,6 +33,75 @@ int scull_qset = SCULL_QSET;
 struct scull_dev *scull_devices;    /* allocated in scull_init_module */
 
 
+/*
+ * Ring devices reuse the quantum slots round-robin: logical quantum n
+ * lives in slot n % ring_quanta. Map a logical offset to the offset in
+ * the quantum list where it is stored.
+ */
+static loff_t scull_ring_map(struct scull_dev *dev, loff_t pos)
+{
+    long qnum;
+
+    if (!dev->ring_quanta)
+        return pos;
+    qnum = (long) pos / dev->quantum;
+    return (loff_t) (qnum % dev->ring_quanta) * dev->quantum
+        + (long) pos % dev->quantum;
+}
+
+/*
+ * First logical offset still held by a ring device. The quantum being
+ * written is the newest one, so the ring covers the ring_quanta quanta
+ * ending with it; anything before was overwritten.
+ */
+static unsigned long scull_ring_start(struct scull_dev *dev)
+{
+    long last;
+
+    if (!dev->ring_quanta || !dev->size)
+        return 0;
+    last = (dev->size - 1) / dev->quantum;
+    if (last < dev->ring_quanta)
+        return 0;
+    return (last - dev->ring_quanta + 1) * dev->quantum;
+}
+
+/*
+ * Check a read position against the data kept by a ring device: either
+ * skip forward to the oldest data or refuse with -ESPIPE.
+ */
+static loff_t scull_ring_check(struct scull_dev *dev, loff_t pos)
+{
+    unsigned long start = scull_ring_start(dev);
+
+    if (pos >= start)
+        return pos;
+    if (dev->ring_flags & SCULL_RING_SKIP)
+        return start;
+    return -ESPIPE;
+}
+
+/*
+ * The quantum size an empty device gets for its access hint: big ones
+ * for streams, page-sized ones for scattered accesses, where a big
+ * quantum would mostly be slack.
+ */
+static int scull_hint_quantum(struct scull_dev *dev)
+{
+    switch (dev->hint) {
+        case SCULL_HINT_SEQUENTIAL:
+        case SCULL_HINT_WRITEONCE:
+            return SCULL_QUANTUM_SEQ;
+        case SCULL_HINT_RANDOM:
+            return PAGE_SIZE;
+        default:
+            return scull_quantum;
+    }
+}
+
+static void scull_numa_stat(struct scull_dev *dev, struct scull_numa_stat *st);
+static void scull_stat(struct scull_dev *dev, struct scull_stat *st);
+
 #ifdef SCULL_DEBUG /* use proc only if debugging */
 /*
  * Here are our sequence iteration methods. Our "position" is 
@@ -56,6 +130,9 @@ static void scull_seq_stop(struct seq_file *s, void *v)
 static int scull_seq_show(struct seq_file *s, void *v)
 {
     struct scull_dev *dev = (struct scull_dev *) v;
+    struct scull_numa_stat nst;
+    struct scull_stat st;
+    struct scull_frag fr;
     struct scull_qset *d;
     int i;
 
@@ -64,6 +141,29 @@ static int scull_seq_show(struct seq_file *s, void *v)
     seq_printf(s, "\nDevice %i: qset %i, q %i, sz %li\n",
               (int) (dev - scull_devices), dev->qset,
               dev->quantum, dev->size);
+    if (dev->ring_quanta)
+        seq_printf(s, " ring of %i quanta, oldest data at %li\n",
+                  dev->ring_quanta, scull_ring_start(dev));
+    if (dev->sealed)
+        seq_printf(s, " sealed\n");
+    if (dev->hint)
+        seq_printf(s, " access hint %i\n", dev->hint);
+    scull_stat(dev, &st);
+    seq_printf(s, " %lu quanta in %lu qsets, %lu extents of %lu bytes, %lu allocations\n",
+              st.quanta, st.qsets, st.extents, st.extent_bytes, st.allocs);
+    scull_frag(dev, &fr);
+    seq_printf(s, " %lu empty qsets, %lu empty slots, %lu bytes slack, %u%% occupancy\n",
+              fr.empty_qsets, fr.empty_slots, fr.slack_bytes, fr.occupancy);
+    scull_numa_stat(dev, &nst);
+    seq_printf(s, " quanta per node:");
+    for (i = 0; i < min_t(int, nr_node_ids, SCULL_NUMA_NODES); i++)
+        seq_printf(s, " %lu", nst.quanta[i]);
+    seq_printf(s, "\n extent pages per node:");
+    for (i = 0; i < min_t(int, nr_node_ids, SCULL_NUMA_NODES); i++)
+        seq_printf(s, " %lu", nst.extent_pages[i]);
+    seq_printf(s, "\n");
+    if (dev->kv_mode)
+        seq_printf(s, " kv store of %lu keys\n", scull_kv_nkeys(dev));
     for (d = dev->data; d; d = d->next) {
         /* scan the list */
         seq_printf(s, " item at %p, qset at %p\n", d, d->data);
@@ -127,17 +227,13 @@ static void scull_remove_proc(void)
 }
 #endif /*SCULL_DEBUG*/
 
-/*
- * Empty out the scull device; must be called with the device 
- * semaphore held.
- */
-int scull_trim(struct scull_dev *dev)
+/* Free a quantum list, which need not be attached to a device any more */
+void scull_free_qsets(struct scull_qset *dptr, int qset)
 {
-    struct scull_qset *next, *dptr;
-    int qset = dev->qset;   /* "dev" is not-null */
+    struct scull_qset *next;
     int i;
-    
-    for(dptr = dev->data; dptr; dptr = next) {
+
+    for(; dptr; dptr = next) {
         if(dptr->data) {
             for (i = 0; i < qset; i++)
                 kfree(dptr->data[i]);
@@ -147,8 +243,22 @@ int scull_trim(struct scull_dev *dev)
         next = dptr->next;
         kfree(dptr);
     }
+}
+
+/*
+ * Empty out the scull device; must be called with the device 
+ * semaphore held.
+ */
+int scull_trim(struct scull_dev *dev)
+{
+    /* lockless kv readers may still be looking at the quanta */
+    scull_kv_clear(dev);
+    scull_extent_trim(dev);
+    
+    scull_free_qsets(dev->data, dev->qset);   /* "dev" is not-null */
     dev->size = 0;
-    dev->quantum = scull_quantum;
+    dev->allocs = 0;
+    dev->quantum = scull_hint_quantum(dev);
     dev->qset = scull_qset;
     dev->data = NULL;
     return 0;
@@ -161,8 +271,21 @@ int scull_open(struct inode *inode, struct file *filp)
     dev = container_of(inode->i_cdev, struct scull_dev, cdev);
     filp->private_data = dev;   /* for other methods */
 
-    /* now trim to o the lenght of the device if open was write-only */
-    if((filp->f_flags & O_ACCMODE) == O_WRONLY){
+    /* a write-only open would trim, which a seal forbids */
+    if ((filp->f_flags & O_ACCMODE) == O_WRONLY && dev->sealed)
+        return -EPERM;
+    /* ... and which would pull the pages from under exported buffers */
+    if ((filp->f_flags & O_ACCMODE) == O_WRONLY && dev->exports
+            && !dev->ring_quanta && !dev->kv_mode)
+        return -EBUSY;
+
+    /*
+     * now trim to o the lenght of the device if open was write-only;
+     * a ring device is a flight recorder and keeps its history,
+     * a kv device is only changed through ioctl()
+     */
+    if((filp->f_flags & O_ACCMODE) == O_WRONLY && !dev->ring_quanta
+            && !dev->kv_mode){
         scull_trim(dev);    /* ignore errors */
     }
     return 0;
@@ -186,6 +309,7 @@ struct scull_qset *scull_follow(struct scull_dev *dev, int n)
         if (qs == NULL)
             return NULL;    /* Never mind */
         memset(qs, 0, sizeof(struct scull_qset));
+        dev->allocs++;
     }
 
     /* Then follow the list */
@@ -195,6 +319,7 @@ struct scull_qset *scull_follow(struct scull_dev *dev, int n)
             if (qs->next == NULL)
                 return NULL;    /* Never mind */
             memset(qs->next, 0, sizeof(struct scull_qset));
+            dev->allocs++;
         }
         qs = qs->next;
         continue;
@@ -202,44 +327,334 @@ struct scull_qset *scull_follow(struct scull_dev *dev, int n)
     return qs;
 }
 
+/*
+ * Return the slot of the quantum list that points to the quantum for
+ * offset "pos". With "create" the qset and its pointer array are
+ * allocated if need be (NULL means no memory); without it nothing is
+ * changed and NULL means there is no slot yet.
+ */
+void **scull_slot(struct scull_dev *dev, loff_t pos, int create)
+{
+    struct scull_qset *dptr;
+    int quantum = dev->quantum, qset = dev->qset;
+    int itemsize = quantum * qset;
+    int item, s_pos;
+
+    item = (long) pos / itemsize;
+    s_pos = ((long) pos % itemsize) / quantum;
+
+    if (create) {
+        dptr = scull_follow(dev, item);
+        if (dptr && !dptr->data) {
+            dptr->data = kmalloc(qset * sizeof(char *), GFP_KERNEL);
+            if (dptr->data) {
+                memset(dptr->data, 0, qset * sizeof(char *));
+                dev->allocs++;
+            }
+        }
+    } else {
+        dptr = dev->data;
+        while (dptr && item--)
+            dptr = dptr->next;
+    }
+    if (!dptr || !dptr->data)
+        return NULL;
+    return &dptr->data[s_pos];
+}
+
+/*
+ * The first offset scull_slot() can't address: it takes positions as
+ * a long and counts qsets in an int. Sizes and offsets that come from
+ * user space are checked against it.
+ */
+static loff_t scull_max_pos(struct scull_dev *dev)
+{
+    int itemsize = dev->quantum * dev->qset;
+
+    return min_t(loff_t, (loff_t) INT_MAX * itemsize, LONG_MAX);
+}
+
+/*
+ * Free the pointer arrays that have no quantum left, then the qsets
+ * after the last one that still has some. Qsets in the middle of the
+ * list must stay, as their place in the list gives their offset.
+ * Called with the device mutex held.
+ */
+void scull_prune(struct scull_dev *dev)
+{
+    struct scull_qset *dptr, *next, *last = NULL;
+    int i;
+
+    for (dptr = dev->data; dptr; dptr = dptr->next) {
+        if (!dptr->data)
+            continue;
+        for (i = 0; i < dev->qset; i++)
+            if (dptr->data[i])
+                break;
+        if (i < dev->qset) {
+            last = dptr;
+            continue;
+        }
+        kfree(dptr->data);
+        dptr->data = NULL;
+    }
+
+    dptr = last ? last->next : dev->data;
+    if (last)
+        last->next = NULL;
+    else
+        dev->data = NULL;
+    for (; dptr; dptr = next) {
+        next = dptr->next;
+        kfree(dptr);
+    }
+}
+
+/*
+ * The node the device's placement policy asks for the next piece of
+ * memory. The node is only a preference: when it is out of memory the
+ * allocator falls back to the others.
+ */
+int scull_alloc_node(struct scull_dev *dev)
+{
+    switch (dev->numa_policy) {
+        case SCULL_NUMA_NODE:
+            return dev->numa_node;
+
+        case SCULL_NUMA_INTERLEAVE:
+            dev->numa_next = next_node_in(dev->numa_next,
+                                          node_states[N_MEMORY]);
+            return dev->numa_next;
+
+        default:    /* SCULL_NUMA_LOCAL: wherever the writer runs */
+            return NUMA_NO_NODE;
+    }
+}
+
+static void *scull_alloc_quantum(struct scull_dev *dev)
+{
+    void *qptr = kmalloc_node(dev->quantum, GFP_KERNEL, scull_alloc_node(dev));
+
+    if (qptr)
+        dev->allocs++;
+    return qptr;
+}
+
+/*
+ * Return the quantum holding offset "pos" of the quantum list,
+ * allocating it (and the way to it) if need be. NULL means no memory.
+ */
+char *scull_get_quantum(struct scull_dev *dev, loff_t pos)
+{
+    void **slot = scull_slot(dev, pos, 1);
+
+    if (!slot)
+        return NULL;
+    if (!*slot)
+        *slot = scull_alloc_quantum(dev);
+    return *slot;
+}
+
+/*
+ * Count the quanta and extent pages of a device per NUMA node; must be
+ * called with the device mutex held. Nodes past the end of the table are counted in
+ * its last entry.
+ */
+static void scull_numa_stat(struct scull_dev *dev, struct scull_numa_stat *st)
+{
+    struct scull_qset *dptr;
+    int i, nid;
+
+    memset(st, 0, sizeof(*st));
+    for (dptr = dev->data; dptr; dptr = dptr->next) {
+        if (!dptr->data)
+            continue;
+        for (i = 0; i < dev->qset; i++) {
+            if (!dptr->data[i])
+                continue;
+            nid = page_to_nid(virt_to_page(dptr->data[i]));
+            st->quanta[min(nid, SCULL_NUMA_NODES - 1)]++;
+        }
+    }
+    scull_extent_numa_stat(dev, st);
+}
+
+static int scull_set_numa(struct scull_dev *dev, struct scull_numa *numa)
+{
+    switch (numa->policy) {
+        case SCULL_NUMA_LOCAL:
+        case SCULL_NUMA_INTERLEAVE:
+            break;
+
+        case SCULL_NUMA_NODE:
+            if (numa->node < 0 || numa->node >= nr_node_ids
+                    || !node_state(numa->node, N_MEMORY))
+                return -EINVAL;
+            break;
+
+        default:
+            return -EINVAL;
+    }
+    if (mutex_lock_interruptible(&dev->mutex))
+        return -ERESTARTSYS;
+    dev->numa_policy = numa->policy;
+    dev->numa_node = numa->node;
+    mutex_unlock(&dev->mutex);
+    return 0;
+}
+
+/*
+ * Like scull_get_quantum(), but never allocates: NULL is a hole. It
+ * doesn't change the list, so it is safe without the mutex once the
+ * device is sealed.
+ */
+char *scull_find_quantum(struct scull_dev *dev, loff_t pos)
+{
+    void **slot = scull_slot(dev, pos, 0);
+
+    return slot ? *slot : NULL;
+}
+
+/*
+ * Find the memory behind (ring-mapped) offset "pos" of the device. On
+ * return *len is cut down to what is contiguous from there: the rest
+ * of the extent or quantum, never running into an extent. Extents
+ * take precedence over quanta. With "create" a missing quantum is
+ * allocated (NULL means no memory); without it NULL means a hole.
+ */
+char *scull_locate(struct scull_dev *dev, loff_t pos, size_t *len, int create)
+{
+    int q_pos = (long) pos % dev->quantum;
+    char *ptr;
+
+    ptr = scull_extent_locate(dev, pos, len);
+    if (ptr)
+        return ptr;
+    *len = min(*len, (size_t) (dev->quantum - q_pos));
+    ptr = create ? scull_get_quantum(dev, pos) : scull_find_quantum(dev, pos);
+    return ptr ? ptr + q_pos : NULL;
+}
+
+/*
+ * Fill in the usage statistics; called with the device mutex held.
+ */
+static void scull_stat(struct scull_dev *dev, struct scull_stat *st)
+{
+    struct scull_qset *dptr;
+    int i;
+
+    memset(st, 0, sizeof(*st));
+    st->size = dev->size;
+    st->allocs = dev->allocs;
+    for (dptr = dev->data; dptr; dptr = dptr->next) {
+        st->qsets++;
+        if (!dptr->data)
+            continue;
+        for (i = 0; i < dev->qset; i++)
+            if (dptr->data[i])
+                st->quanta++;
+    }
+    scull_extent_stat(dev, st);
+}
+
+/*
+ * Start pulling in the quantum (or extent) at "pos", as much of it as
+ * the last read took, so that the next read finds it in the cache.
+ */
+static void scull_prefetch(struct scull_dev *dev, loff_t pos, size_t count)
+{
+    size_t len = min_t(size_t, count, SCULL_PREFETCH_MAX);
+    char *next;
+
+    if (pos >= dev->size)
+        return;
+    next = scull_locate(dev, pos, &len, 0);
+    if (next)
+        prefetch_range(next, len);
+}
+
+/*
+ * A writer expected to go on sequentially gets the next qset and its
+ * pointer array as soon as it writes to the last quantum of this one,
+ * rather than when it first needs them. Failure is not an error: the
+ * write that needs them will try again.
+ */
+static void scull_prealloc(struct scull_dev *dev, loff_t pos)
+{
+    long qnum = (long) pos / dev->quantum;
+
+    if (qnum % dev->qset == dev->qset - 1)
+        scull_slot(dev, (loff_t) (qnum + 1) * dev->quantum, 1);
+}
+
+/*
+ * Read from a sealed device. Its contents will never change again, so
+ * readers neither take the mutex nor write anything shared.
+ */
+static ssize_t scull_read_sealed(struct scull_dev *dev, char __user *buf,
+        size_t count, loff_t *f_pos)
+{
+    loff_t pos = *f_pos;
+    char *ptr;
+
+    if (dev->ring_quanta) {
+        pos = scull_ring_check(dev, pos);
+        if (pos < 0)
+            return pos;
+    }
+    if (pos >= dev->size)
+        return 0;
+    if (pos + count > dev->size)
+        count = dev->size - pos;
+
+    ptr = scull_locate(dev, scull_ring_map(dev, pos), &count, 0);
+    if (ptr ? copy_to_user(buf, ptr, count) : clear_user(buf, count))
+        return -EFAULT;
+    *f_pos = pos + count;
+    return count;
+}
+
 ssize_t scull_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
 {
     struct scull_dev *dev = filp->private_data;
-    struct scull_qset *dptr;    /* 第一个链表项 */
-    int quantum = dev->quantum, qset = dev->qset;
-    int itemsize = quantum * qset;  /* 该链表中有多少个字节 */
-    int item, s_pos, q_pos, rest;   
+    char *ptr;
+    loff_t pos;
     ssize_t retval = 0;
 
+    /* pairs with smp_store_release() in scull_seal() */
+    if (smp_load_acquire(&dev->sealed))
+        return scull_read_sealed(dev, buf, count, f_pos);
+
     if(mutex_lock_interruptible(&dev->mutex))
         return -ERESTARTSYS;
+    if (dev->ring_quanta) {
+        pos = scull_ring_check(dev, *f_pos);
+        if (pos < 0) {
+            retval = pos;
+            goto out;
+        }
+        *f_pos = pos;
+    }
     if(*f_pos >= dev->size)
         goto out;
     if(*f_pos + count > dev->size)
         count = dev->size - *f_pos;
 
-    /* 在量子集中寻找链表项、qset索引以及偏移量 */
-    item = (long) *f_pos / itemsize;
-    rest = (long) *f_pos % itemsize;
-    s_pos = rest / quantum; q_pos = rest % quantum;
-
-    /* 沿该链表前行，直到正确的位置（在其他地方定义）*/
-    dptr = scull_follow(dev, item);
-
-    if(dptr == NULL || !dptr->data || !dptr->data[s_pos])
-        goto out;   /* don't fill holes */
-
-    /* 读取该量子的数据直到结尾 */
-    if (count > quantum - q_pos)
-        count = quantum - q_pos;
-
-    if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
+    /* 找到该位置所在的区段或量子，最多读到它的结尾；空洞读出来是 0 */
+    pos = scull_ring_map(dev, *f_pos);
+    ptr = scull_locate(dev, pos, &count, 0);
+    if (ptr ? copy_to_user(buf, ptr, count) : clear_user(buf, count)) {
         retval = -EFAULT;
         goto out;
     }
     *f_pos += count;
     retval = count;
 
+    /* a sequential reader that finished a quantum goes on with the next */
+    if ((dev->hint == SCULL_HINT_SEQUENTIAL || dev->hint == SCULL_HINT_WILLNEED)
+            && !dev->ring_quanta && (long) *f_pos % dev->quantum == 0)
+        scull_prefetch(dev, *f_pos, count);
+
 out:
     mutex_unlock(&dev->mutex);
     return retval;
@@ -248,46 +663,44 @@ out:
 ssize_t scull_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
 {
     struct scull_dev *dev = filp->private_data;
-    struct scull_qset *dptr;
-    int quantum = dev->quantum, qset = dev->qset;
-    int itemsize = quantum * qset;
-    int item, s_pos, q_pos, rest;
+    char *ptr;
+    loff_t pos;
     ssize_t retval = -ENOMEM;   /* “goto out” 语句使用的值 */
 
     if (mutex_lock_interruptible(&dev->mutex))
         return -ERESTARTSYS;
 
-    /* 在量子集中寻找链表项、qset索引以及偏移量 */
-    item = (long) *f_pos / itemsize;
-    rest = (long) *f_pos % itemsize;
-    s_pos = rest / quantum; q_pos = rest % quantum;
-
-    /* 沿该链表前行，直到正确的位置（在其他地方定义）*/
-    dptr = scull_follow(dev, item);
-    if (dptr == NULL)
+    /* records of a kv device must not change under lockless readers */
+    if (dev->kv_mode || dev->sealed) {
+        retval = -EPERM;
         goto out;
-    if (!dptr->data) {
-        dptr->data = kmalloc(qset * sizeof(char *), GFP_KERNEL);
-        if (!dptr->data)
-            goto out;
-        memset(dptr->data, 0, qset * sizeof(char *));
     }
-    if (!dptr->data[s_pos]) {
-        dptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
-        if (!dptr->data[s_pos])
-            goto out;
-    }
-    /* 将数据写入该量子，直到结尾*/
-    if (count > quantum - q_pos)
-        count = quantum - q_pos;
 
-    if (copy_from_user(dptr->data[s_pos]+q_pos, buf, count)) {
+    /* a flight recorder only ever appends */
+    if (dev->ring_quanta)
+        *f_pos = dev->size;
+
+    /* 大块的追加写入使用区段 */
+    pos = scull_ring_map(dev, *f_pos);
+    if (dev->extent_mode && *f_pos == dev->size)
+        scull_extent_grow(dev, pos, count);
+
+    /* 找到该位置所在的区段或量子（必要时分配），最多写到它的结尾 */
+    ptr = scull_locate(dev, pos, &count, 1);
+    if (ptr == NULL)
+        goto out;
+
+    if (copy_from_user(ptr, buf, count)) {
         retval = -EFAULT;
         goto out;
     }
     *f_pos += count;
     retval = count;
 
+    if (dev->hint != SCULL_HINT_NORMAL && dev->hint != SCULL_HINT_RANDOM
+            && !dev->ring_quanta && !dev->extent_mode)
+        scull_prealloc(dev, *f_pos - 1);
+
     /* 更新文件大小 */
     if (dev->size < *f_pos)
         dev->size = *f_pos;
@@ -297,11 +710,345 @@ out:
     return retval;
 }
 
+/*
+ * Lock two devices in a fixed order, so that two copies running in
+ * opposite directions can't deadlock.
+ */
+static int scull_lock_two(struct scull_dev *a, struct scull_dev *b)
+{
+    if (a == b)
+        return mutex_lock_interruptible(&a->mutex) ? -ERESTARTSYS : 0;
+    if (a > b)
+        swap(a, b);
+    if (mutex_lock_interruptible(&a->mutex))
+        return -ERESTARTSYS;
+    if (mutex_lock_interruptible_nested(&b->mutex, SINGLE_DEPTH_NESTING)) {
+        mutex_unlock(&a->mutex);
+        return -ERESTARTSYS;
+    }
+    return 0;
+}
+
+static void scull_unlock_two(struct scull_dev *a, struct scull_dev *b)
+{
+    if (a != b)
+        mutex_unlock(&b->mutex);
+    mutex_unlock(&a->mutex);
+}
+
+/*
+ * Copy one piece of a range, never crossing a quantum or extent on
+ * either side. With SCULL_COPY_MOVE a whole, aligned quantum of two
+ * devices without extents just changes hands;
+ * otherwise the bytes are copied. A hole in the source stays a hole
+ * (or reads as zeroes, where the destination already had memory).
+ */
+static ssize_t scull_copy_chunk(struct scull_dev *src, loff_t spos,
+        struct scull_dev *dst, loff_t dpos, size_t count, int move)
+{
+    void **sslot, **dslot;
+    char *from, *to;
+
+    if (move && !((long) spos % src->quantum) && !((long) dpos % dst->quantum)
+            && count >= src->quantum && src->quantum == dst->quantum
+            && RB_EMPTY_ROOT(&src->extents.rb_root)
+            && RB_EMPTY_ROOT(&dst->extents.rb_root)) {
+        count = src->quantum;
+        sslot = scull_slot(src, spos, 0);
+        if (sslot && *sslot) {
+            dslot = scull_slot(dst, dpos, 1);
+            if (!dslot)
+                return -ENOMEM;
+            kfree(*dslot);
+            *dslot = *sslot;
+            *sslot = NULL;
+        } else {
+            dslot = scull_slot(dst, dpos, 0);
+            if (dslot) {
+                kfree(*dslot);
+                *dslot = NULL;
+            }
+        }
+        return count;
+    }
+
+    from = scull_locate(src, spos, &count, 0);
+    if (from) {
+        to = scull_locate(dst, dpos, &count, 1);
+        if (!to)
+            return -ENOMEM;
+        memcpy(to, from, count);
+    } else {
+        to = scull_locate(dst, dpos, &count, 0);
+        if (to)
+            memset(to, 0, count);
+    }
+    return count;
+}
+
+/*
+ * In-kernel copy from another scull device (FICLONERANGE style: the
+ * ioctl goes to the destination). No byte goes through user space,
+ * and moving quanta copies nothing at all.
+ */
+static long scull_copy_range(struct scull_dev *dst, struct scull_copy_range *cr)
+{
+    struct scull_dev *src;
+    struct fd f;
+    size_t done = 0, len;
+    ssize_t chunk = 0;
+    int move = cr->flags & SCULL_COPY_MOVE;
+    long retval;
+
+    cr->copied = 0;
+    if (cr->flags & ~SCULL_COPY_MOVE)
+        return -EINVAL;
+    /* no offset or end may wrap as a loff_t */
+    if (cr->src_offset > LLONG_MAX || cr->dest_offset > LLONG_MAX
+            || cr->src_length > LLONG_MAX - cr->dest_offset)
+        return -EINVAL;
+    f = fdget(cr->src_fd);
+    if (!f.file)
+        return -EBADF;
+    retval = -EINVAL;
+    if (f.file->f_op != &scull_fops)
+        goto out_fdput;
+    retval = -EBADF;
+    if (!(f.file->f_mode & FMODE_READ))
+        goto out_fdput;
+    src = f.file->private_data;
+
+    retval = scull_lock_two(src, dst);
+    if (retval)
+        goto out_fdput;
+
+    retval = -EPERM;
+    if (dst->sealed || dst->kv_mode || (move && (src->sealed || src->kv_mode)))
+        goto out;
+    retval = -EINVAL;
+    if (src->ring_quanta || dst->ring_quanta)
+        goto out;
+    retval = -EBUSY;
+    if (move && (src->exports || dst->exports))
+        goto out;
+    retval = -EINVAL;
+    if (cr->src_offset >= scull_max_pos(src) || cr->dest_offset >= scull_max_pos(dst))
+        goto out;
+    if (cr->src_offset >= src->size) {
+        retval = 0;
+        goto out;
+    }
+    len = min_t(u64, cr->src_length, src->size - cr->src_offset);
+    if (src == dst && cr->src_offset < cr->dest_offset + len
+            && cr->dest_offset < cr->src_offset + len)
+        goto out;   /* overlapping */
+    if (cr->dest_offset + len > scull_max_pos(dst))
+        goto out;
+
+    while (done < len) {
+        chunk = scull_copy_chunk(src, cr->src_offset + done,
+                                 dst, cr->dest_offset + done,
+                                 len - done, move);
+        if (chunk < 0)
+            break;
+        done += chunk;
+        cond_resched();
+    }
+    if (dst->size < cr->dest_offset + done)
+        dst->size = cr->dest_offset + done;
+    cr->copied = done;
+    retval = done ? 0 : chunk;
+
+out:
+    scull_unlock_two(src, dst);
+out_fdput:
+    fdput(f);
+    return retval;
+}
+
+/*
+ * The "extended" operations -- only seek
+ */
+loff_t scull_llseek(struct file *filp, loff_t off, int whence)
+{
+    struct scull_dev *dev = filp->private_data;
+    loff_t newpos;
+
+    if (mutex_lock_interruptible(&dev->mutex))
+        return -ERESTARTSYS;
+    switch(whence) {
+        case 0: /* SEEK_SET */
+            newpos = off;
+            break;
+
+        case 1: /* SEEK_CUR */
+            newpos = filp->f_pos + off;
+            break;
+
+        case 2: /* SEEK_END */
+            newpos = dev->size + off;
+            break;
+
+        default: /* can't happen */
+            newpos = -EINVAL;
+    }
+    if (newpos < 0)
+        newpos = -EINVAL;
+    else if (dev->ring_quanta)
+        newpos = scull_ring_check(dev, newpos);
+    if (newpos >= 0)
+        filp->f_pos = newpos;
+    mutex_unlock(&dev->mutex);
+    return newpos;
+}
+
+/*
+ * Turn ring mode on or off. The layout of the quanta changes, so the
+ * device is emptied first.
+ */
+static int scull_set_ring(struct scull_dev *dev, struct scull_ring *ring)
+{
+    if (ring->quanta < 0 || (ring->flags & ~SCULL_RING_SKIP))
+        return -EINVAL;
+    if (mutex_lock_interruptible(&dev->mutex))
+        return -ERESTARTSYS;
+    if (dev->kv_mode || dev->extent_mode || dev->exports || dev->sealed) {
+        mutex_unlock(&dev->mutex);
+        return dev->sealed ? -EPERM : -EBUSY;
+    }
+    scull_trim(dev);
+    dev->ring_quanta = ring->quanta;
+    dev->ring_flags = ring->quanta ? ring->flags : 0;
+    mutex_unlock(&dev->mutex);
+    return 0;
+}
+
+/*
+ * Turn extent mode on or off. Only future appends are affected; the
+ * extents already there stay until the device is trimmed.
+ */
+static int scull_set_extent(struct scull_dev *dev, int on)
+{
+    int retval = 0;
+
+    if (mutex_lock_interruptible(&dev->mutex))
+        return -ERESTARTSYS;
+    if (dev->ring_quanta || dev->kv_mode)
+        retval = -EBUSY;
+    else
+        dev->extent_mode = on ? 1 : 0;
+    mutex_unlock(&dev->mutex);
+    return retval;
+}
+
+/*
+ * Record the access hint. An empty device gets the hint's quantum size
+ * right away, one with data at its next trim.
+ */
+static int scull_set_hint(struct scull_dev *dev, int hint)
+{
+    if (hint < SCULL_HINT_NORMAL || hint > SCULL_HINT_WILLNEED)
+        return -EINVAL;
+    if (mutex_lock_interruptible(&dev->mutex))
+        return -ERESTARTSYS;
+    if (dev->sealed) {
+        mutex_unlock(&dev->mutex);
+        return -EPERM;
+    }
+    dev->hint = hint;
+    if (!dev->data && RB_EMPTY_ROOT(&dev->extents.rb_root))
+        dev->quantum = scull_hint_quantum(dev);
+    mutex_unlock(&dev->mutex);
+    return 0;
+}
+
+/*
+ * Set the size of the device, like ftruncate(). Shrinking frees the
+ * quanta and extents that lie wholly beyond the new end; growing leaves
+ * a hole, which reads as zeros. Either way the rest of the quantum or
+ * extent holding the lower of the two ends is cleared, so that no old
+ * data shows up again if the device grows later.
+ */
+static int scull_truncate(struct scull_dev *dev, unsigned long len)
+{
+    struct scull_qset *dptr;
+    loff_t itemsize = (loff_t) dev->quantum * dev->qset;
+    loff_t pos;
+    size_t n;
+    char *ptr;
+    int item, i;
+
+    if (mutex_lock_interruptible(&dev->mutex))
+        return -ERESTARTSYS;
+    if (dev->sealed) {
+        mutex_unlock(&dev->mutex);
+        return -EPERM;
+    }
+    if (dev->ring_quanta || dev->kv_mode || (dev->exports && len < dev->size)) {
+        mutex_unlock(&dev->mutex);
+        return -EBUSY;
+    }
+    if (len > scull_max_pos(dev)) {
+        mutex_unlock(&dev->mutex);
+        return -EINVAL;
+    }
+
+    if (len < dev->size) {
+        scull_extent_truncate(dev, len);
+        for (dptr = dev->data, item = 0; dptr; dptr = dptr->next, item++) {
+            if (!dptr->data)
+                continue;
+            for (i = 0; i < dev->qset; i++) {
+                pos = item * itemsize + (loff_t) i * dev->quantum;
+                if (pos >= len && dptr->data[i]) {
+                    kfree(dptr->data[i]);
+                    dptr->data[i] = NULL;
+                }
+            }
+        }
+        scull_prune(dev);
+    }
+
+    pos = min(len, dev->size);
+    n = max(len, dev->size) - pos;
+    ptr = n ? scull_locate(dev, pos, &n, 0) : NULL;
+    if (ptr)
+        memset(ptr, 0, n);
+    dev->size = len;
+    mutex_unlock(&dev->mutex);
+    return 0;
+}
+
+/*
+ * Seal the device, memfd style: from now on it is read-only (writes,
+ * trims and mode changes fail with -EPERM) and reads skip the mutex.
+ * There is no way back short of unloading the module.
+ */
+static int scull_seal(struct scull_dev *dev)
+{
+    if (mutex_lock_interruptible(&dev->mutex))
+        return -ERESTARTSYS;
+    if (dev->exports) {
+        mutex_unlock(&dev->mutex);
+        return -EBUSY;  /* a dma-buf mapping could still change it */
+    }
+    smp_store_release(&dev->sealed, 1);
+    mutex_unlock(&dev->mutex);
+    return 0;
+}
+
 /* 
  * The ioctl() implementation
  */
 long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
+    struct scull_dev *dev = filp->private_data;
+    struct scull_copy_range cr;
+    struct scull_numa_stat nst;
+    struct scull_numa numa;
+    struct scull_ring ring;
+    struct scull_frag fr;
+    struct scull_stat st;
     int err = 0, tmp;
     int retval = 0;
 
@@ -400,6 +1147,100 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
             scull_qset = arg;
             return tmp;
 
+        case SCULL_IOCSRING:
+            if (copy_from_user(&ring, (void __user *)arg, sizeof(ring)))
+                return -EFAULT;
+            return scull_set_ring(dev, &ring);
+
+        case SCULL_IOCGRING:
+            ring.quanta = dev->ring_quanta;
+            ring.flags = dev->ring_flags;
+            if (copy_to_user((void __user *)arg, &ring, sizeof(ring)))
+                return -EFAULT;
+            break;
+
+        case SCULL_IOCSEAL:
+            return scull_seal(dev);
+
+        case SCULL_IOCQSEAL:
+            return dev->sealed;
+
+        case SCULL_IOCTKV:
+            return scull_kv_enable(dev, arg);
+
+        case SCULL_IOCCOPY:
+            if (!(filp->f_mode & FMODE_WRITE))
+                return -EBADF;
+            if (copy_from_user(&cr, (void __user *)arg, sizeof(cr)))
+                return -EFAULT;
+            retval = scull_copy_range(dev, &cr);
+            if (!retval && copy_to_user((void __user *)arg, &cr, sizeof(cr)))
+                return -EFAULT;
+            return retval;
+
+        case SCULL_IOCSNUMA:
+            if (copy_from_user(&numa, (void __user *)arg, sizeof(numa)))
+                return -EFAULT;
+            return scull_set_numa(dev, &numa);
+
+        case SCULL_IOCGNUMA:
+            numa.policy = dev->numa_policy;
+            numa.node = dev->numa_node;
+            if (copy_to_user((void __user *)arg, &numa, sizeof(numa)))
+                return -EFAULT;
+            break;
+
+        case SCULL_IOCGNUMASTAT:
+            if (mutex_lock_interruptible(&dev->mutex))
+                return -ERESTARTSYS;
+            scull_numa_stat(dev, &nst);
+            mutex_unlock(&dev->mutex);
+            if (copy_to_user((void __user *)arg, &nst, sizeof(nst)))
+                return -EFAULT;
+            break;
+
+        case SCULL_IOCTEXTENT:
+            return scull_set_extent(dev, arg);
+
+        case SCULL_IOCGSTAT:
+            if (mutex_lock_interruptible(&dev->mutex))
+                return -ERESTARTSYS;
+            scull_stat(dev, &st);
+            mutex_unlock(&dev->mutex);
+            if (copy_to_user((void __user *)arg, &st, sizeof(st)))
+                return -EFAULT;
+            break;
+
+        case SCULL_IOCTTRUNC:
+            return scull_truncate(dev, arg);
+
+        case SCULL_IOCTHINT:
+            return scull_set_hint(dev, arg);
+
+        case SCULL_IOCQHINT:
+            return dev->hint;
+
+        case SCULL_IOCEXPORT:
+            return scull_export_ioctl(filp, arg);
+
+        case SCULL_IOCTCOMPACT:
+            return scull_compact(dev, arg);
+
+        case SCULL_IOCGFRAG:
+            if (mutex_lock_interruptible(&dev->mutex))
+                return -ERESTARTSYS;
+            scull_frag(dev, &fr);
+            mutex_unlock(&dev->mutex);
+            if (copy_to_user((void __user *)arg, &fr, sizeof(fr)))
+                return -EFAULT;
+            break;
+
+        case SCULL_IOCKVPUT:
+        case SCULL_IOCKVGET:
+        case SCULL_IOCKVDEL:
+        case SCULL_IOCKVMGET:
+            return scull_kv_ioctl(dev, cmd, arg);
+
         /* 
          * The following two change the buffer size for scullpipe.
          * The scullpipe device uses this same ioctl method, just to 
@@ -422,6 +1263,7 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
 struct file_operations scull_fops = {
     .owner = THIS_MODULE,
+    .llseek = scull_llseek,
     .read = scull_read,
     .write = scull_write,
     .unlocked_ioctl = scull_ioctl,
@@ -441,8 +1283,11 @@ void scull_cleanup_module(void)
 
     /* Get rid of our char dev entries */
     if (scull_devices){
+        scull_compact_stop();
         for(i = 0; i < scull_nr_devs; i++) {
+            scull_compact_cancel(scull_devices + i);
             scull_trim(scull_devices + i);
+            scull_kv_cleanup(scull_devices + i);
             cdev_del(&scull_devices[i].cdev);
         }
         kfree(scull_devices);
@@ -514,8 +1359,10 @@ static int scull_init(void)
         scull_devices[i].quantum = scull_quantum;
         scull_devices[i].qset = scull_qset;
         mutex_init(&scull_devices[i].mutex);
+        scull_compact_init(&scull_devices[i]);
         scull_setup_cdev(&scull_devices[i], i);
     }
+    scull_compact_start();
 
     /* At this point call the init function for any friend device */
     dev = MKDEV(scull_major, scull_minor + scull_nr_devs);
@@ -28,31 +28,422 @@
 #include <linux/cdev.h>
 #include <asm/uaccess.h>
 #include <linux/sched.h>
+#include <linux/sched/clock.h>
+#include <linux/sched/signal.h>
 #include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/cache.h>
+#include <linux/capability.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/vmalloc.h>
+#include <linux/ktime.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
 
 #include "scull.h"		/* local definitions */
 
 
+/*
+ * The buffer is a single-producer/single-consumer ring. Its size is a
+ * power of two, and "head" and "tail" count the bytes ever written and
+ * read, so head - tail is what the buffer holds and the buffer can be
+ * filled up completely. Only the writer moves head and only the reader
+ * moves tail; each publishes its index with a release store, which the
+ * other side reads with an acquire load. A reader and a writer thus
+ * never share a lock: readers only serialize among themselves on
+ * rmutex, writers on wmutex. "mutex" guards the buffer itself, for
+ * open, release and resize.
+ *
+ * The ring is made of single pages rather than one kmalloc()ed block,
+ * so that splice can give whole pages to a pipe, or take them from
+ * one, instead of copying them. Swapping the page under some part of
+ * the ring is only done by the side that owns that part: the reader
+ * for pages full of data, the writer for free ones.
+ *
+ * In record mode every write is stored as a u32 length followed by the
+ * data, and head moves past the whole record at once, so a reader
+ * always sees complete records. Changing the mode takes all three
+ * mutexes, in the order mutex, rmutex, wmutex.
+ *
+ * Resizing takes them too, and copies the data into the new ring at
+ * the same indices, so head and tail need not change.
+ *
+ * A big ring is also mapped twice in a row with vmap(), the mirror:
+ * index i and i + size land on the same byte, so any stretch of up to
+ * size bytes from any index is contiguous there, and copies go in one
+ * piece. The mirror is what a reader can mmap(). Its pages may then
+ * never be swapped, so splice copies instead of moving pages.
+ *
+ * To measure how long data waits in the ring, writers can stamp what
+ * they publish: each move of head queues the new head and the time in
+ * a small ring of stamps, filled under wmutex and emptied under rmutex
+ * like the ring itself. Readers retire the stamps that tail has
+ * passed, and count how old they were.
+ *
+ * A sleeper only wants to be woken once there is enough to read, or
+ * enough room to write: its low watermark. Before it checks the ring
+ * it stores that amount in rwant or wwant, keeping the smallest one
+ * there, and the other side wakes the queue only when the ring has
+ * that much. Waking resets the threshold to UINT_MAX (nobody waiting),
+ * and the sleepers still short set it again.
+ *
+ * Blocking readers and writers wait exclusively, and each one decides
+ * in its own wake function whether the ring has what it waits for: one
+ * that is still short stays asleep and doesn't use up the wakeup, so an
+ * event wakes a single task, and one that can go on. Whatever it leaves
+ * over is passed on to the next sleeper when it is done. Poll waiters
+ * get the event as the key, so EPOLLEXCLUSIVE entries share the queues
+ * the same way.
+ *
+ * In broadcast mode every reader gets every byte: each open file reads
+ * from its own cursor, and readers wait non-exclusively, as an event
+ * is for all of them. With SCULL_P_BCAST_BLOCK, tail is the cursor of
+ * the slowest reader, kept up to date by the readers. With
+ * SCULL_P_BCAST_OVERRUN the writer owns tail: it moves it forward to
+ * make room, and a reader whose cursor falls behind it has lost data.
+ *
+ * Urgent messages don't queue up behind the buffer: each priority above
+ * 0 has a lane of its own, a page-sized ring of messages with a u32
+ * length before each, kept 4-byte aligned. Writers fill the lanes under
+ * wmutex and readers empty them under rmutex, with the same release and
+ * acquire of the indices as the buffer. They skip the thresholds and
+ * wake the queues directly, since a single message is all a reader
+ * needs.
+ */
+#define SCULL_P_LANE_SIZE PAGE_SIZE
+
+struct scull_p_lane {
+    char *buf;                          /* SCULL_P_LANE_SIZE bytes, or NULL */
+    unsigned int head, tail;            /* as for the buffer */
+};
+
+#define SCULL_P_STAMPS 256      /* a power of two */
+
+struct scull_p_stamps {
+    struct {
+        unsigned int end;               /* head, after the write */
+        ktime_t t;                      /* when it was written */
+    } q[SCULL_P_STAMPS];
+    unsigned int head, tail;            /* as for the buffer */
+    unsigned long hist[SCULL_P_LAT_BUCKETS];    /* under rmutex */
+    unsigned long dropped;              /* under wmutex */
+};
+
 struct scull_pipe {
     wait_queue_head_t inq, outq;        /* read and write queues */
-    char *buffer, *end;                 /* begin of buf, end of buf */
-    int buffersize;                     /* used in pointer arithmetic */
-    char *rp, *wp;                      /* where to read, where to write */
+    struct page **pages;                /* the ring */
+    char *vaddr;                        /* the mirror, or NULL */
+    atomic_t mmaps;                     /* user mappings of the mirror */
+    unsigned int size;                  /* of the ring, a power of two */
+    unsigned int setsize;               /* set by ioctl, 0: scull_p_buffer */
+    unsigned int head ____cacheline_aligned_in_smp; /* where to write */
+    unsigned int tail ____cacheline_aligned_in_smp; /* where to read */
+    unsigned int rwant, wwant;          /* bytes the sleepers wait for */
+    atomic_t rsleepers, wsleepers;      /* blocked in read and write */
+    unsigned int record;                /* max record size, 0: byte stream */
+    unsigned int bcast;                 /* broadcast policy, 0: off */
+    int persist;                        /* keep the buffer when closed */
+    struct scull_p_lane lanes[SCULL_P_LANES - 1];   /* urgent messages, by priority */
+    struct list_head readers;           /* files open for reading, under rmutex */
+    unsigned int peak;                  /* most bytes held, under wmutex */
+    unsigned long full;                 /* writers that found no room */
+    struct scull_p_stamps *stamps;      /* latency mode, or NULL */
+    atomic64_t blocked_ns;              /* writers asleep waiting for room */
+    atomic_long_t blocked;
     int nreaders, nwriters;              /* number of openings for r/w */
     struct fasync_struct *async_queue;  /* asynchronous readers */
+    struct mutex rmutex, wmutex;        /* one reader, one writer at a time */
     struct mutex mutex;                 /* mutual exclusion semaphore */
     struct cdev cdev;
 };
 
+/* What each open file keeps */
+struct scull_p_file {
+    struct scull_pipe *dev;
+    unsigned int rcvlowat;              /* wake a reader at so many bytes */
+    unsigned int sndlowat;              /* wake a writer at so much room */
+    struct list_head list;              /* in dev->readers */
+    unsigned int cursor;                /* where to read, in broadcast mode */
+    unsigned long skipped;              /* bytes lost to overruns */
+    unsigned int prio;                  /* what writes go to, 0: the buffer */
+    unsigned int busy_poll;             /* most microseconds to spin, 0: none */
+    u64 busy_ns;                        /* how long the next spin lasts */
+    unsigned int rcvtimeo, sndtimeo;    /* in milliseconds, 0: forever */
+};
+
 /* parameters */
+#define SCULL_P_HDR sizeof(u32)     /* record header: the record length */
+
 static int scull_p_nr_devs = SCULL_P_NR_DEVS;   /* number of pipe devices */
 int scull_p_buffer = SCULL_P_BUFFER;    /* buffer size */
+static unsigned int scull_p_max_size = 4 << 20;  /* largest size without CAP_SYS_RESOURCE */
+module_param(scull_p_max_size, uint, S_IRUGO | S_IWUSR);
+static int scull_p_pool = SCULL_P_NR_DEVS;  /* free rings kept for reuse */
+module_param(scull_p_pool, int, S_IRUGO | S_IWUSR);
+static int scull_p_mirror_min = 1 << 20;   /* smallest ring to mirror */
+module_param(scull_p_mirror_min, int, S_IRUGO | S_IWUSR);
+static int scull_p_busy_poll = 0;       /* default busy polling, in microseconds */
+module_param(scull_p_busy_poll, int, S_IRUGO | S_IWUSR);
 dev_t scull_p_devno;    /* Our first device number */
 
 static struct scull_pipe *scull_p_devices;
 
 
-static int spacefree(struct scull_pipe *dev);
+static unsigned int spacefree(struct scull_pipe *dev);
+static unsigned int scull_p_avail(struct scull_pipe *dev);
+static unsigned int scull_p_ravail(struct scull_pipe *dev, struct scull_p_file *pf);
+
+/*
+ * Allocate and free the pages of a ring of "size" bytes, which is a
+ * power of two and at least a page.
+ */
+static struct page **scull_p_alloc_pages(unsigned int size)
+{
+    unsigned int i, n = size >> PAGE_SHIFT;
+    struct page **pages;
+
+    /* a big ring has a big page array: let that come from vmalloc */
+    pages = kvcalloc(n, sizeof(struct page *), GFP_KERNEL);
+    if (!pages)
+        return NULL;
+    for (i = 0; i < n; i++) {
+        /* zeroed: a reader may mmap() the ring, written or not */
+        pages[i] = alloc_page(GFP_KERNEL | __GFP_ZERO);
+        if (!pages[i]) {
+            while (i--)
+                __free_page(pages[i]);
+            kvfree(pages);
+            return NULL;
+        }
+    }
+    return pages;
+}
+
+static void scull_p_free_pages(struct page **pages, unsigned int size)
+{
+    unsigned int i;
+
+    if (!pages)
+        return;
+    for (i = 0; i < size >> PAGE_SHIFT; i++)
+        put_page(pages[i]);
+    kvfree(pages);
+}
+
+/*
+ * Map a ring twice in a row, if it is big enough to be worth it. NULL
+ * just means no mirror: the ring is then used a page at a time.
+ */
+static char *scull_p_vmap(struct page **pages, unsigned int size)
+{
+    unsigned int i, n = size >> PAGE_SHIFT;
+    struct page **twice;
+    void *addr;
+
+    if (size < READ_ONCE(scull_p_mirror_min))
+        return NULL;
+    twice = kvmalloc_array(2 * n, sizeof(struct page *), GFP_KERNEL);
+    if (!twice)
+        return NULL;
+    for (i = 0; i < n; i++)
+        twice[i] = twice[i + n] = pages[i];
+    addr = vmap(twice, 2 * n, VM_MAP, PAGE_KERNEL);
+    kvfree(twice);
+    return addr;
+}
+
+static void scull_p_vunmap(char *vaddr)
+{
+    if (vaddr)
+        vunmap(vaddr);
+}
+
+/*
+ * The pool of free rings. A device gives its ring back when the last
+ * file is closed, or when it is resized, and the next open of any
+ * device that wants a ring of that size takes it from here instead of
+ * allocating one page at a time. Only rings of the default size are
+ * kept, so that a device resized to a huge ring doesn't leave it pinned
+ * here; up to scull_p_pool of them, and that many are made at load
+ * time. A ring taken from the pool is cleared first: it may hold what
+ * another device had in it.
+ */
+struct scull_p_ring {
+    struct list_head list;
+    struct page **pages;
+    unsigned int size;
+};
+
+static LIST_HEAD(scull_p_free_rings);
+static DEFINE_MUTEX(scull_p_pool_lock);
+static int scull_p_nfree;
+static unsigned long scull_p_pool_hits, scull_p_pool_misses;
+
+/* What a new ring is made of, unless the device was resized */
+static unsigned int scull_p_default_size(void)
+{
+    return roundup_pow_of_two(max_t(int, scull_p_buffer, PAGE_SIZE));
+}
+
+static void scull_p_clear_ring(struct page **pages, unsigned int size)
+{
+    unsigned int i;
+
+    for (i = 0; i < size >> PAGE_SHIFT; i++) {
+        clear_highpage(pages[i]);
+        cond_resched();
+    }
+}
+
+static struct page **scull_p_get_ring(unsigned int size)
+{
+    struct scull_p_ring *r;
+    struct page **pages = NULL;
+
+    mutex_lock(&scull_p_pool_lock);
+    list_for_each_entry(r, &scull_p_free_rings, list) {
+        if (r->size == size) {
+            list_del(&r->list);
+            scull_p_nfree--;
+            pages = r->pages;
+            kfree(r);
+            break;
+        }
+    }
+    if (pages)
+        scull_p_pool_hits++;
+    else
+        scull_p_pool_misses++;
+    mutex_unlock(&scull_p_pool_lock);
+    if (!pages)
+        return scull_p_alloc_pages(size);
+    scull_p_clear_ring(pages, size);
+    return pages;
+}
+
+/*
+ * Give a ring back to the pool, or free it if the pool is full or the
+ * ring is not of the default size.
+ */
+static void scull_p_put_ring(struct page **pages, unsigned int size)
+{
+    struct scull_p_ring *r = NULL;
+
+    if (!pages)
+        return;
+    if (size == scull_p_default_size())
+        r = kmalloc(sizeof(struct scull_p_ring), GFP_KERNEL);
+    mutex_lock(&scull_p_pool_lock);
+    if (r && scull_p_nfree < READ_ONCE(scull_p_pool)) {
+        r->pages = pages;
+        r->size = size;
+        list_add(&r->list, &scull_p_free_rings);
+        scull_p_nfree++;
+        pages = NULL;
+    }
+    mutex_unlock(&scull_p_pool_lock);
+    if (pages) {
+        kfree(r);
+        scull_p_free_pages(pages, size);
+    }
+}
+
+static void scull_p_pool_fill(void)
+{
+    unsigned int size = scull_p_default_size();
+    struct page **pages;
+    int i;
+
+    for (i = 0; i < scull_p_pool; i++) {
+        pages = scull_p_alloc_pages(size);
+        if (!pages)
+            break;
+        scull_p_put_ring(pages, size);
+    }
+}
+
+static void scull_p_pool_drain(void)
+{
+    struct scull_p_ring *r, *next;
+
+    list_for_each_entry_safe(r, next, &scull_p_free_rings, list) {
+        list_del(&r->list);
+        scull_p_free_pages(r->pages, r->size);
+        kfree(r);
+    }
+    scull_p_nfree = 0;
+}
+
+/*
+ * Broadcast with SCULL_P_BCAST_BLOCK: move tail up to the slowest
+ * reader, or to head if there is none. Called with rmutex held.
+ */
+static void scull_p_bcast_tail(struct scull_pipe *dev)
+{
+    unsigned int head = smp_load_acquire(&dev->head), tail = head;
+    struct scull_p_file *pf;
+
+    list_for_each_entry(pf, &dev->readers, list)
+        if (head - pf->cursor > head - tail)
+            tail = pf->cursor;
+    smp_store_release(&dev->tail, tail);
+}
+
+/* Free the urgent lanes, once nobody has the device open */
+static void scull_p_free_lanes(struct scull_pipe *dev)
+{
+    int i;
+
+    for (i = 0; i < SCULL_P_LANES - 1; i++) {
+        kfree(dev->lanes[i].buf);
+        dev->lanes[i].buf = NULL;
+        dev->lanes[i].head = dev->lanes[i].tail = 0;
+    }
+}
+
+/*
+ * Stamp data just published, up to "head"; called under wmutex. When
+ * the stamps run out the write goes unstamped, and its data counts as
+ * part of the next one.
+ */
+static void scull_p_stamp(struct scull_pipe *dev, unsigned int head)
+{
+    struct scull_p_stamps *st = dev->stamps;
+    unsigned int i;
+
+    if (!st)
+        return;
+    i = st->head;
+    if (i - smp_load_acquire(&st->tail) == SCULL_P_STAMPS) {
+        st->dropped++;
+        return;
+    }
+    st->q[i & (SCULL_P_STAMPS - 1)].end = head;
+    st->q[i & (SCULL_P_STAMPS - 1)].t = ktime_get();
+    smp_store_release(&st->head, i + 1);
+}
+
+/* Retire the stamps tail has moved past, and count them; under rmutex */
+static void scull_p_stamp_done(struct scull_pipe *dev, unsigned int tail)
+{
+    struct scull_p_stamps *st = dev->stamps;
+    unsigned int i, b;
+    ktime_t now;
+
+    if (!st)
+        return;
+    now = ktime_get();
+    for (i = st->tail; i != smp_load_acquire(&st->head); i++) {
+        if ((int) (tail - st->q[i & (SCULL_P_STAMPS - 1)].end) < 0)
+            break;
+        b = ilog2((u64) ktime_to_ns(ktime_sub(now, st->q[i & (SCULL_P_STAMPS - 1)].t)) | 1);
+        st->hist[min_t(unsigned int, b, SCULL_P_LAT_BUCKETS - 1)]++;
+    }
+    smp_store_release(&st->tail, i);
+}
+
+static void scull_p_wake_writers(struct scull_pipe *dev);
 
 /*
  * Open and close
@@ -60,28 +451,65 @@ static int spacefree(struct scull_pipe *dev);
 static int scull_p_open(struct inode *inode, struct file *filp)
 {
     struct scull_pipe *dev;
+    struct scull_p_file *pf;
 
     dev = container_of(inode->i_cdev, struct scull_pipe, cdev);
-    filp->private_data = dev;
+    /* zeroed: poll() looks at the cursor of write-only files too */
+    pf = kzalloc(sizeof(struct scull_p_file), GFP_KERNEL);
+    if (!pf)
+        return -ENOMEM;
+    pf->dev = dev;
+    pf->rcvlowat = pf->sndlowat = 1;
+    pf->skipped = 0;
+    pf->prio = 0;
+    pf->rcvtimeo = pf->sndtimeo = 0;
+    pf->busy_poll = clamp(READ_ONCE(scull_p_busy_poll), 0, (int) USEC_PER_SEC);
+    pf->busy_ns = (u64) pf->busy_poll * NSEC_PER_USEC;
+    INIT_LIST_HEAD(&pf->list);
+    filp->private_data = pf;
 
-    if (mutex_lock_interruptible(&dev->mutex))
+    if (mutex_lock_interruptible(&dev->mutex)) {
+        kfree(pf);
         return -ERESTARTSYS;
+    }
 
-    if (!dev->buffer) {
-        /* allocate the buffer */
-        dev->buffer = kmalloc(scull_p_buffer, GFP_KERNEL);
-        if (!dev->buffer) {
+    if (!dev->pages) {
+        /* allocate the buffer: a power of two, and whole pages */
+        dev->size = dev->setsize ? dev->setsize : scull_p_default_size();
+        dev->pages = scull_p_get_ring(dev->size);
+        if (!dev->pages) {
             mutex_unlock(&dev->mutex);
+            kfree(pf);
             return -ENOMEM;
         }
+        dev->vaddr = scull_p_vmap(dev->pages, dev->size);
+        /*
+         * rd and wr from the beginning; only a new buffer may be reset,
+         * as readers and writers don't take dev->mutex
+         */
+        dev->head = dev->tail = 0;
+        dev->peak = 0;
+        if (dev->stamps)
+            dev->stamps->head = dev->stamps->tail = 0;
+        /* the buffer may have shrunk since record mode was set */
+        if (dev->record > dev->size - SCULL_P_HDR)
+            dev->record = dev->size - SCULL_P_HDR;
     }
-    dev->buffersize = scull_p_buffer;
-    dev->end = dev->buffer + dev->buffersize;
-    dev->rp = dev->wp = dev->buffer;    /* rd and wr from the beginning */
 
     /* use f_mode, not f_flags: it's cleaner (fs/open.c tells why) */
-    if (filp->f_mode & FMODE_READ)
+    if (filp->f_mode & FMODE_READ) {
+        /* a broadcast reader gets what is written from now on */
+        mutex_lock(&dev->rmutex);
+        pf->cursor = READ_ONCE(dev->head);
+        list_add(&pf->list, &dev->readers);
+        /* what was written for nobody is dropped, and the writers go on */
+        if (dev->bcast == SCULL_P_BCAST_BLOCK)
+            scull_p_bcast_tail(dev);
+        mutex_unlock(&dev->rmutex);
+        if (dev->bcast == SCULL_P_BCAST_BLOCK)
+            scull_p_wake_writers(dev);
         dev->nreaders++;
+    }
     if (filp->f_mode & FMODE_WRITE)
         dev->nwriters++;
     mutex_unlock(&dev->mutex);
@@ -91,169 +519,1577 @@ static int scull_p_open(struct inode *inode, struct file *filp)
 
 static int scull_p_release(struct inode *inode, struct file *filp)
 {
-    struct scull_pipe *dev = filp->private_data;
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
 
     /* remove this filp from the asynchronously notified filp's */
     //scull_p_fasync(-1, filp, 0);
-    mutex_lock_interruptible(&dev->mutex);
-    if (filp->f_mode & FMODE_READ)
+    mutex_lock(&dev->mutex);
+    if (filp->f_mode & FMODE_READ) {
+        mutex_lock(&dev->rmutex);
+        list_del(&pf->list);
+        /* the slowest broadcast reader may be leaving */
+        if (dev->bcast == SCULL_P_BCAST_BLOCK)
+            scull_p_bcast_tail(dev);
+        mutex_unlock(&dev->rmutex);
         dev->nreaders--;
+    }
     if (filp->f_mode & FMODE_WRITE)
         dev->nwriters--;
-    if (dev->nreaders + dev->nwriters == 0) {
-        kfree(dev->buffer);
-        dev->buffer = NULL;  /* the other fields are not checked on open */
+    if (dev->nreaders + dev->nwriters == 0 && !dev->persist) {
+        /* nobody has it mapped any more: a mapping holds the file */
+        scull_p_vunmap(dev->vaddr);
+        dev->vaddr = NULL;
+        scull_p_put_ring(dev->pages, dev->size);
+        dev->pages = NULL;  /* the other fields are not checked on open */
+        scull_p_free_lanes(dev);
+    } else if (dev->bcast == SCULL_P_BCAST_BLOCK) {
+        scull_p_wake_writers(dev);
     }
     mutex_unlock(&dev->mutex);
+    kfree(pf);
     return 0;
 }
 
 /*
  * Data managment: read and write
  */
-static ssize_t scull_p_read(struct file *filp, char __user *buf, size_t count, loff_t *f_ops)
+/* The address of the byte at index "idx" of a ring */
+static char *scull_p_ring_addr(struct page **pages, unsigned int size,
+        unsigned int idx)
 {
-    struct scull_pipe *dev = filp->private_data;
+    unsigned int off = idx & (size - 1);
 
-    if (mutex_lock_interruptible(&dev->mutex))
-        return -ERESTARTSYS;
+    return page_address(pages[off >> PAGE_SHIFT]) + offset_in_page(off);
+}
 
-    while (dev->rp == dev->wp) { // nothing to read
-        mutex_unlock(&dev->mutex); // release the lock
-        if (filp->f_flags & O_NONBLOCK)
-            return -EAGAIN;
-        PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
-        if (wait_event_interruptible(dev->inq, (dev->rp != dev->wp)))
-            return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
-        /* otherwise loop, but first reacquire the lock */
-        if (mutex_lock_interruptible(&dev->mutex))
-            return -ERESTARTSYS;
+static char *scull_p_addr(struct scull_pipe *dev, unsigned int idx)
+{
+    if (dev->vaddr)
+        return dev->vaddr + (idx & (dev->size - 1));
+    return scull_p_ring_addr(dev->pages, dev->size, idx);
+}
+
+/* How much of "n" bytes from "idx" on is contiguous: all, in the mirror */
+static size_t scull_p_chunk(struct scull_pipe *dev, unsigned int idx, size_t n)
+{
+    if (dev->vaddr)
+        return n;
+    return min_t(size_t, n, PAGE_SIZE - offset_in_page(idx));
+}
+
+/*
+ * Copy "n" bytes between the ring, from index "idx" on, and user or
+ * kernel memory. The bytes may cross pages and wrap around the end of
+ * the buffer, so without a mirror this goes a page at a time.
+ */
+static int scull_p_copy_out(struct scull_pipe *dev, unsigned int idx,
+        char __user *buf, size_t n)
+{
+    size_t chunk;
+
+    for (; n; n -= chunk, idx += chunk, buf += chunk) {
+        chunk = scull_p_chunk(dev, idx, n);
+        if (copy_to_user(buf, scull_p_addr(dev, idx), chunk))
+            return -EFAULT;
     }
-    /* ok, data is there, return something */
-    if (dev->wp > dev->rp)
-        count = min(count, (size_t)(dev->wp - dev->rp));
-    else /* the write pointer has wrapped, return data up to dev->end */
-        count = min(count, (size_t)(dev->end - dev->rp));
-    if (copy_to_user(buf, dev->rp, count)) {
-        mutex_unlock(&dev->mutex);
-        return -EFAULT;
+    return 0;
+}
+
+static int scull_p_copy_in(struct scull_pipe *dev, unsigned int idx,
+        const char __user *buf, size_t n)
+{
+    size_t chunk;
+
+    for (; n; n -= chunk, idx += chunk, buf += chunk) {
+        chunk = scull_p_chunk(dev, idx, n);
+        if (copy_from_user(scull_p_addr(dev, idx), buf, chunk))
+            return -EFAULT;
     }
-    dev->rp += count;
-    if (dev->rp == dev->end)
-        dev->rp = dev->buffer; /* wrapped */
-    mutex_unlock(&dev->mutex);
+    return 0;
+}
 
-    /* finally, awake any writers and return */
-    wake_up_interruptible(&dev->outq);
-    PDEBUG("\"%s\" did read %li bytes\n", current->comm, (long)count);
-    return count;
+static void scull_p_peek(struct scull_pipe *dev, unsigned int idx, void *dst, size_t n)
+{
+    size_t chunk;
+
+    for (; n; n -= chunk, idx += chunk, dst += chunk) {
+        chunk = scull_p_chunk(dev, idx, n);
+        memcpy(dst, scull_p_addr(dev, idx), chunk);
+    }
 }
 
-/* Wait for space for writing; caller must hold device semaphore. On
- * error the semaphore will be release before returning. */
-static int scull_getwritespace(struct scull_pipe *dev, struct file *filp)
+static void scull_p_poke(struct scull_pipe *dev, unsigned int idx, const void *src, size_t n)
 {
-    while (spacefree(dev) == 0) { // full
-        DEFINE_WAIT(wait);
+    size_t chunk;
 
-        mutex_unlock(&dev->mutex);
-        if (filp->f_flags & O_NONBLOCK)
-            return -EAGAIN;
-        PDEBUG("\"%s\" writing: going to sleep\n", current->comm);
-        prepare_to_wait(&dev->outq, &wait, TASK_INTERRUPTIBLE);
-        if (spacefree(dev) == 0)
-            schedule();
-        finish_wait(&dev->outq, &wait);
-        if (signal_pending(current))
-            return -ERESTARTSYS;    /* signal: tell the fs layer to handle */
-        if (mutex_lock_interruptible(&dev->mutex))
-            return -ERESTARTSYS;
+    for (; n; n -= chunk, idx += chunk, src += chunk) {
+        chunk = scull_p_chunk(dev, idx, n);
+        memcpy(scull_p_addr(dev, idx), src, chunk);
     }
-    return 0;
 }
 
-/* How much space is free? */
-static int spacefree(struct scull_pipe *dev)
+/*
+ * The urgent lanes: room in one, and the highest one holding a message,
+ * if any. Copies to and from a lane wrap around at most once.
+ */
+static unsigned int scull_p_lane_room(struct scull_p_lane *lane)
 {
-    if (dev->rp == dev->wp)
-        return dev->buffersize - 1;
-    return ((dev->rp + dev->buffersize - dev->wp) % dev->buffersize) - 1;
+    return SCULL_P_LANE_SIZE - (READ_ONCE(lane->head) - smp_load_acquire(&lane->tail));
 }
 
-static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_ops)
+static struct scull_p_lane *scull_p_urgent(struct scull_pipe *dev)
 {
-    struct scull_pipe *dev = filp->private_data;
-    int result;
+    struct scull_p_lane *lane;
+    int i;
 
-    if (mutex_lock_interruptible(&dev->mutex))
-        return -ERESTARTSYS;
-    
-    /* Make sure there's space to write */
-    result = scull_getwritespace(dev, filp);
-    if (result)
-        return result;  /* scull_getwritespace called mutex_unlock(&dev->mutex) */
-
-    /* ok, space is there, accept something */
-    count = min(count, (size_t)spacefree(dev));
-    if (dev->wp >= dev->rp)
-        count = min(count, (size_t)(dev->end - dev->wp));   /* to end-of-buf */
-    else /* the write pointer has wrapped, fill up to rp-1 */
-        count = min(count, (size_t)(dev->rp - dev->wp -1));
-    PDEBUG("Going to accept %li bytes to %p from %p\n", (long)count, dev->wp, buf);
-    if (copy_from_user(dev->wp, buf, count)){
-        mutex_unlock(&dev->mutex);
+    for (i = SCULL_P_LANES - 2; i >= 0; i--) {
+        lane = &dev->lanes[i];
+        if (smp_load_acquire(&lane->head) != READ_ONCE(lane->tail))
+            return lane;
+    }
+    return NULL;
+}
+
+static int scull_p_lane_out(struct scull_p_lane *lane, unsigned int idx,
+        char __user *buf, size_t n)
+{
+    unsigned int off = idx & (SCULL_P_LANE_SIZE - 1);
+    size_t chunk = min_t(size_t, n, SCULL_P_LANE_SIZE - off);
+
+    if (copy_to_user(buf, lane->buf + off, chunk)
+            || copy_to_user(buf + chunk, lane->buf, n - chunk))
+        return -EFAULT;
+    return 0;
+}
+
+static int scull_p_lane_in(struct scull_p_lane *lane, unsigned int idx,
+        const char __user *buf, size_t n)
+{
+    unsigned int off = idx & (SCULL_P_LANE_SIZE - 1);
+    size_t chunk = min_t(size_t, n, SCULL_P_LANE_SIZE - off);
+
+    if (copy_from_user(lane->buf + off, buf, chunk)
+            || copy_from_user(lane->buf, buf + chunk, n - chunk))
         return -EFAULT;
+    return 0;
+}
+
+/*
+ * Sleepers set the threshold before checking the ring, wakers publish
+ * their index before looking at it: either the sleeper sees the new
+ * index, or the waker sees the threshold.
+ */
+static void scull_p_arm(unsigned int *want, unsigned int n)
+{
+    unsigned int old = READ_ONCE(*want), prev;
+
+    while (n < old) {
+        prev = cmpxchg(want, old, n);
+        if (prev == old)
+            break;
+        old = prev;
     }
-    dev->wp += count;
-    if (dev->wp == dev->end)
-        dev->wp = dev->buffer;  /* wrapped */
-    mutex_unlock(&dev->mutex);
+    smp_mb();   /* pairs with scull_p_wake() */
+}
 
-    /* finally, awake any reader */
-    wake_up_interruptible(&dev->inq);   /* blocked in read() and select() */
+static void scull_p_wake(wait_queue_head_t *q, unsigned int *want, unsigned int have,
+        __poll_t event)
+{
+    unsigned int old;
 
-    /* and signal asynchronous readers, explained late in chapter 5 */
-    if (dev->async_queue)
-        kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
-    PDEBUG("\"%s\" did write %li bytes\n", current->comm, (long)count);
-    return count;
+    smp_mb();   /* pairs with scull_p_arm() */
+    old = READ_ONCE(*want);
+    if (have < old)
+        return;
+    /* a sleeper that armed since then keeps its threshold */
+    cmpxchg(want, old, UINT_MAX);
+    wake_up_interruptible_poll(q, event);
 }
 
+/*
+ * There is new data: wake a reader, if it has enough. A broadcast
+ * reader may be further behind than tail, so any threshold will do.
+ */
+static void scull_p_wake_readers(struct scull_pipe *dev)
+{
+    unsigned int have = READ_ONCE(dev->bcast) ? UINT_MAX - 1 : scull_p_avail(dev);
+
+    scull_p_wake(&dev->inq, &dev->rwant, have, EPOLLIN | EPOLLRDNORM);
+}
 
-static unsigned int scull_p_poll(struct file *filp, poll_table *wait)
+/* There is new room: wake a writer, if it has enough */
+static void scull_p_wake_writers(struct scull_pipe *dev)
+{
+    scull_p_wake(&dev->outq, &dev->wwant, spacefree(dev), EPOLLOUT | EPOLLWRNORM);
+}
+
+/* With "urgent", an urgent message is as good as "need" bytes */
+static int scull_p_readable(struct scull_pipe *dev, struct scull_p_file *pf,
+        unsigned int need, int urgent)
 {
-    struct scull_pipe *dev = filp->private_data;
-    unsigned int mask = 0;
+    scull_p_arm(&dev->rwant, need);
+    return scull_p_ravail(dev, pf) >= need || (urgent && scull_p_urgent(dev));
+}
 
-    /*
-     * The buffer is circular; it is considered full
-     * if "wp" is right behind "rp" and empty if the 
-     * two are equal.
-     */
-    /*
-     * 缓冲区是环形的；也就是说，如果wp在rp之后，则表明缓冲区
-     * 已满，而如果它们两个相等，则表明是空的。
-     */
-    mutex_lock_interruptible(&dev->mutex);
-    poll_wait(filp, &dev->inq, wait);
-    poll_wait(filp, &dev->outq, wait);
-    if (dev->rp != dev->wp)
-        mask |= POLLIN | POLLRDNORM;
-    if (spacefree(dev))
-        mask |= POLLOUT | POLLWRNORM;
-    mutex_unlock(&dev->mutex);
-    return mask;
+static int scull_p_writable(struct scull_pipe *dev, unsigned int need)
+{
+    scull_p_arm(&dev->wwant, need);
+    return spacefree(dev) >= need;
 }
 
-/* FIXME this should use seq_file */
-#ifdef SCULL_DEBUG
+struct scull_p_wait {
+    struct wait_queue_entry wq;
+    struct scull_pipe *dev;
+    struct scull_p_file *pf;            /* the reader */
+    unsigned int need;
+    int write, urgent;
+};
+
+static int scull_p_ready(struct scull_pipe *dev, struct scull_p_file *pf,
+        int write, unsigned int need, int urgent)
+{
+    return write ? scull_p_writable(dev, need)
+                 : scull_p_readable(dev, pf, need, urgent);
+}
 
-//static int scull_read_p_mem(struct seq_file *s, void *v)
-//{
-//
-//}
+static int scull_p_wake_fn(struct wait_queue_entry *wq, unsigned int mode,
+        int sync, void *key)
+{
+    struct scull_p_wait *w = container_of(wq, struct scull_p_wait, wq);
+    struct scull_pipe *dev = w->dev;
 
-#endif 
+    if (!scull_p_ready(dev, w->pf, w->write, w->need, w->urgent))
+        return 0;   /* still short, and armed again */
+    /* the walk stops here: those behind us must be looked at next time */
+    scull_p_arm(w->write ? &dev->wwant : &dev->rwant, 1);
+    return autoremove_wake_function(wq, mode, sync, key);
+}
+
+/*
+ * After a read or a write: if what is left is of use to another
+ * sleeper, pass the wakeup on.
+ */
+static void scull_p_pass(struct scull_pipe *dev, int write)
+{
+    smp_mb();   /* our index before their count, as in scull_p_wake() */
+    if (write) {
+        if (atomic_read(&dev->wsleepers) && spacefree(dev))
+            wake_up_interruptible_poll(&dev->outq, EPOLLOUT | EPOLLWRNORM);
+    } else {
+        if (atomic_read(&dev->rsleepers) && (scull_p_avail(dev) || scull_p_urgent(dev)))
+            wake_up_interruptible_poll(&dev->inq, EPOLLIN | EPOLLRDNORM);
+    }
+}
+
+/* A timeout in milliseconds, as jiffies to sleep; 0 means forever */
+static long scull_p_timeo(unsigned int ms)
+{
+    return ms ? msecs_to_jiffies(ms) : MAX_SCHEDULE_TIMEOUT;
+}
+
+/*
+ * Sleep until "need" bytes can be read by "pf", or written; a reader
+ * with "urgent" also wakes up for an urgent message. "timeo" is what
+ * is left of the caller's timeout, and is updated.
+ */
+static int scull_p_wait(struct scull_pipe *dev, struct scull_p_file *pf,
+        int write, unsigned int need, int urgent, long *timeo)
+{
+    wait_queue_head_t *q = write ? &dev->outq : &dev->inq;
+    atomic_t *sleepers = write ? &dev->wsleepers : &dev->rsleepers;
+    struct scull_p_wait w = { .dev = dev, .pf = pf, .need = need,
+                              .write = write, .urgent = urgent };
+    int ret = 0;
+
+    init_wait(&w.wq);
+    w.wq.func = scull_p_wake_fn;
+    atomic_inc(sleepers);
+    for (;;) {
+        /* broadcast data is for every reader */
+        if (write || !READ_ONCE(dev->bcast))
+            prepare_to_wait_exclusive(q, &w.wq, TASK_INTERRUPTIBLE);
+        else
+            prepare_to_wait(q, &w.wq, TASK_INTERRUPTIBLE);
+        if (scull_p_ready(dev, pf, write, need, urgent))
+            break;
+        if (signal_pending(current)) {
+            ret = -ERESTARTSYS;
+            break;
+        }
+        if (!*timeo) {
+            ret = -ETIMEDOUT;
+            break;
+        }
+        *timeo = schedule_timeout(*timeo);
+    }
+    finish_wait(q, &w.wq);
+    atomic_dec(sleepers);
+    if (ret)
+        scull_p_pass(dev, write);   /* we may have taken someone's wakeup */
+    return ret;
+}
+
+/*
+ * Spin for a while before going to sleep, with rmutex released, until
+ * there is something to read or the time is up. A spin that gets its
+ * data makes the next one longer, one that runs out makes it shorter,
+ * so a file whose data comes late wastes less time waiting for it.
+ * The spin never outlasts "timeo", and what it takes is charged to it.
+ * Returns 1 if the data came.
+ */
+static int scull_p_spin(struct scull_pipe *dev, struct scull_p_file *pf,
+        unsigned int need, int urgent, long *timeo)
+{
+    u64 limit = (u64) pf->busy_poll * NSEC_PER_USEC;
+    u64 start = local_clock(), end = start + pf->busy_ns, now;
+    int got;
+
+    if (*timeo != MAX_SCHEDULE_TIMEOUT)
+        end = min(end, start + jiffies_to_nsecs(*timeo));
+    for (;;) {
+        got = scull_p_ravail(dev, pf) >= need || (urgent && scull_p_urgent(dev));
+        now = local_clock();
+        if (got || need_resched() || signal_pending(current))
+            break;
+        if (now >= end) {
+            pf->busy_ns = max(pf->busy_ns / 2, limit / 8);
+            break;
+        }
+        cpu_relax();
+    }
+    if (got)
+        pf->busy_ns = min(pf->busy_ns * 2, limit);
+    if (*timeo != MAX_SCHEDULE_TIMEOUT)     /* round up, or short spins are free */
+        *timeo -= min_t(long, *timeo, nsecs_to_jiffies(now - start + TICK_NSEC - 1));
+    return got;
+}
+
+/* Wait for "need" bytes to read, or any with O_NONBLOCK, or with
+ * "urgent" for an urgent message; caller must hold dev->rmutex. On
+ * error the mutex will be released before returning. */
+static int scull_getdata(struct scull_pipe *dev, struct file *filp,
+        unsigned int need, int urgent)
+{
+    struct scull_p_file *pf = filp->private_data;
+    long timeo = scull_p_timeo(pf->rcvtimeo);
+    int result;
+
+    need = clamp_t(unsigned int, need, 1, dev->size);
+    if (filp->f_flags & O_NONBLOCK)
+        need = 1;
+    while (scull_p_ravail(dev, pf) < need
+            && !(urgent && scull_p_urgent(dev))) { // not enough to read
+        mutex_unlock(&dev->rmutex); // release the lock
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (!pf->busy_poll || !scull_p_spin(dev, pf, need, urgent, &timeo)) {
+            PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
+            result = scull_p_wait(dev, pf, 0, need, urgent, &timeo);
+            if (result)
+                return result;  /* a signal, or -ETIMEDOUT */
+        }
+        /* otherwise loop, but first reacquire the lock */
+        if (mutex_lock_interruptible(&dev->rmutex))
+            return -ERESTARTSYS;
+    }
+    return 0;
+}
+
+/*
+ * Broadcast read, from the file's own cursor; called with rmutex held,
+ * which it releases. With SCULL_P_BCAST_OVERRUN the writer may move
+ * tail past the cursor, before the copy or while it runs; the reader
+ * then skips to tail, counts what it lost and fails with -EOVERFLOW.
+ */
+static ssize_t scull_p_bcast_read(struct scull_pipe *dev, struct scull_p_file *pf,
+        char __user *buf, size_t count)
+{
+    unsigned int cursor = pf->cursor, tail;
+    int overrun = dev->bcast == SCULL_P_BCAST_OVERRUN;
+
+    tail = READ_ONCE(dev->tail);
+    if (overrun && (int) (tail - cursor) > 0)
+        goto lost;
+    count = min(count, (size_t) (smp_load_acquire(&dev->head) - cursor));
+    if (scull_p_copy_out(dev, cursor, buf, count)) {
+        mutex_unlock(&dev->rmutex);
+        return -EFAULT;
+    }
+    if (overrun) {
+        smp_rmb();  /* the copy before tail; pairs with scull_p_make_room() */
+        tail = READ_ONCE(dev->tail);
+        if ((int) (tail - cursor) > 0)
+            goto lost;
+    }
+    WRITE_ONCE(pf->cursor, cursor + count);
+    if (!overrun)
+        scull_p_bcast_tail(dev);
+    mutex_unlock(&dev->rmutex);
+
+    if (!overrun)
+        scull_p_wake_writers(dev);
+    return count;
+
+lost:
+    pf->skipped += tail - cursor;
+    WRITE_ONCE(pf->cursor, tail);
+    mutex_unlock(&dev->rmutex);
+    return -EOVERFLOW;
+}
+
+/*
+ * Read the first message of an urgent lane; called with rmutex held,
+ * which it releases. As in record mode, what doesn't fit is dropped.
+ */
+static ssize_t scull_p_read_urgent(struct scull_pipe *dev, struct scull_p_lane *lane,
+        char __user *buf, size_t count)
+{
+    unsigned int tail = lane->tail;
+    u32 len;
+
+    len = *(u32 *) (lane->buf + (tail & (SCULL_P_LANE_SIZE - 1)));
+    count = min_t(size_t, count, len);
+    if (scull_p_lane_out(lane, tail + SCULL_P_HDR, buf, count)) {
+        mutex_unlock(&dev->rmutex);
+        return -EFAULT;
+    }
+    smp_store_release(&lane->tail, tail + SCULL_P_HDR + ALIGN(len, SCULL_P_HDR));
+    mutex_unlock(&dev->rmutex);
+
+    /* urgent writers wait on outq, for room in the lane */
+    if (wq_has_sleeper(&dev->outq))
+        wake_up_interruptible_poll(&dev->outq, EPOLLOUT | EPOLLWRNORM);
+    scull_p_pass(dev, 0);
+    return count;
+}
+
+static ssize_t scull_p_read(struct file *filp, char __user *buf, size_t count, loff_t *f_ops)
+{
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+    struct scull_p_lane *lane;
+    unsigned int tail;
+    u32 len;
+    int result;
+
+    if (mutex_lock_interruptible(&dev->rmutex))
+        return -ERESTARTSYS;
+    /* like SO_RCVLOWAT: wait for the low watermark, or for all of "count" */
+    result = scull_getdata(dev, filp,
+                           dev->record ? 1 : min_t(size_t, count, pf->rcvlowat), 1);
+    if (result)
+        return result;  /* scull_getdata called mutex_unlock(&dev->rmutex) */
+    /* urgent messages go first, the highest priority first */
+    lane = scull_p_urgent(dev);
+    if (lane)
+        return scull_p_read_urgent(dev, lane, buf, count);
+    if (dev->bcast)
+        return scull_p_bcast_read(dev, pf, buf, count);
+
+    tail = dev->tail;
+    if (dev->record) {
+        /* one record per read; what doesn't fit in "buf" is dropped */
+        scull_p_peek(dev, tail, &len, SCULL_P_HDR);
+        count = min_t(size_t, count, len);
+        if (scull_p_copy_out(dev, tail + SCULL_P_HDR, buf, count)) {
+            mutex_unlock(&dev->rmutex);
+            return -EFAULT;
+        }
+        tail += SCULL_P_HDR + len;
+    } else {
+        /* ok, data is there, return all we can, wrapping around if need be */
+        count = min(count, (size_t) scull_p_avail(dev));
+        if (scull_p_copy_out(dev, tail, buf, count)) {
+            mutex_unlock(&dev->rmutex);
+            return -EFAULT;
+        }
+        tail += count;
+    }
+    /* the writer may reuse the space once it sees the new tail */
+    smp_store_release(&dev->tail, tail);
+    scull_p_stamp_done(dev, tail);
+    mutex_unlock(&dev->rmutex);
+
+    /* finally, awake any writers and return */
+    scull_p_wake_writers(dev);
+    scull_p_pass(dev, 0);
+    PDEBUG("\"%s\" did read %li bytes\n", current->comm, (long)count);
+    return count;
+}
+
+/*
+ * Read a batch of records, like recvmmsg(): they are stored back to
+ * back in the user buffer, and their lengths in the "lens" array. The
+ * call waits for the first record only, and stops at the first one
+ * that doesn't fit. Returns the number of records.
+ */
+static long scull_p_recvmmsg(struct file *filp, struct scull_p_mmsg __user *umsg)
+{
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+    struct scull_p_mmsg mm;
+    unsigned int tail, avail, n;
+    unsigned long done = 0;
+    u32 len;
+    int result;
+
+    if (!READ_ONCE(dev->record))
+        return -EINVAL;
+    if (copy_from_user(&mm, umsg, sizeof(mm)))
+        return -EFAULT;
+    if (mutex_lock_interruptible(&dev->rmutex))
+        return -ERESTARTSYS;
+    result = scull_getdata(dev, filp, 1, 0);
+    if (result)
+        return result;
+    if (!dev->record) {
+        mutex_unlock(&dev->rmutex);
+        return -EINVAL;
+    }
+
+    tail = dev->tail;
+    avail = scull_p_avail(dev);
+    for (n = 0; n < mm.nrecs && avail; n++) {
+        scull_p_peek(dev, tail, &len, SCULL_P_HDR);
+        if (len > mm.len - done)
+            break;
+        if (scull_p_copy_out(dev, tail + SCULL_P_HDR, (char __user *) mm.buf + done, len)
+                || put_user(len, (unsigned int __user *) mm.lens + n)) {
+            result = -EFAULT;
+            break;
+        }
+        done += len;
+        tail += SCULL_P_HDR + len;
+        avail -= SCULL_P_HDR + len;
+    }
+    if (n) {
+        smp_store_release(&dev->tail, tail);
+        scull_p_stamp_done(dev, tail);
+    }
+    mutex_unlock(&dev->rmutex);
+
+    if (n) {
+        scull_p_wake_writers(dev);
+        scull_p_pass(dev, 0);
+    }
+    if (!n)
+        return result ? result : -EMSGSIZE;
+    if (put_user(n, &umsg->nrecs))
+        return -EFAULT;
+    return n;
+}
+
+/*
+ * Broadcast with SCULL_P_BCAST_BLOCK and no reader: nobody will ever
+ * read what is in the buffer, so drop it rather than wait. Called with
+ * wmutex held, so it can only try for rmutex; a reader holding that is
+ * on the list anyway. Returns 1 if it made room.
+ */
+static int scull_p_bcast_idle(struct scull_pipe *dev)
+{
+    int idle;
+
+    if (!mutex_trylock(&dev->rmutex))
+        return 0;
+    idle = list_empty(&dev->readers);
+    if (idle)
+        scull_p_bcast_tail(dev);
+    mutex_unlock(&dev->rmutex);
+    return idle;
+}
+
+/* Wait for "need" bytes of space, for at most what is left of "timeo";
+ * caller must hold dev->wmutex. On error the mutex will be released
+ * before returning. */
+static int scull_getwritespace(struct scull_pipe *dev, struct file *filp,
+        unsigned int need, long *timeo)
+{
+    ktime_t start;
+    int result;
+
+    while (spacefree(dev) < need) { // full
+        if (dev->bcast == SCULL_P_BCAST_BLOCK && scull_p_bcast_idle(dev))
+            continue;
+        dev->full++;
+        mutex_unlock(&dev->wmutex);
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        PDEBUG("\"%s\" writing: going to sleep\n", current->comm);
+        start = ktime_get();
+        result = scull_p_wait(dev, NULL, 1, need, 0, timeo);
+        atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)), &dev->blocked_ns);
+        atomic_long_inc(&dev->blocked);
+        if (result)
+            return result;  /* a signal, or -ETIMEDOUT */
+        if (mutex_lock_interruptible(&dev->wmutex))
+            return -ERESTARTSYS;
+    }
+    return 0;
+}
+
+/*
+ * How much space is free, and how much data is there? Each side reads
+ * its own index plainly and the other side's with acquire, so that it
+ * sees the bytes (or the free space) the index was published with.
+ */
+static unsigned int spacefree(struct scull_pipe *dev)
+{
+    /* poll() may look while a resize changes the size */
+    return READ_ONCE(dev->size) - (READ_ONCE(dev->head) - smp_load_acquire(&dev->tail));
+}
+
+static unsigned int scull_p_avail(struct scull_pipe *dev)
+{
+    return smp_load_acquire(&dev->head) - READ_ONCE(dev->tail);
+}
+
+/* What the reader "pf" has to read: in broadcast mode, from its cursor */
+static unsigned int scull_p_ravail(struct scull_pipe *dev, struct scull_p_file *pf)
+{
+    if (READ_ONCE(dev->bcast))
+        return smp_load_acquire(&dev->head) - READ_ONCE(pf->cursor);
+    return scull_p_avail(dev);
+}
+
+/*
+ * Broadcast with SCULL_P_BCAST_OVERRUN: drop the oldest data to make
+ * room for "need" bytes; called with wmutex held. Tail moves before the
+ * space is written to, so a reader copying from it will notice.
+ */
+static void scull_p_make_room(struct scull_pipe *dev, unsigned int need)
+{
+    if (spacefree(dev) >= need)
+        return;
+    WRITE_ONCE(dev->tail, dev->head + need - dev->size);
+    smp_wmb();  /* tail before the data; pairs with scull_p_bcast_read() */
+}
+
+/* Note how full the buffer got; called by writers, under wmutex */
+static void scull_p_account(struct scull_pipe *dev)
+{
+    unsigned int used = dev->head - READ_ONCE(dev->tail);
+
+    if (used > dev->peak)
+        dev->peak = used;
+}
+
+/*
+ * Write one urgent message to the lane of the file's priority. The lane
+ * is allocated the first time, and kept until the device is closed.
+ */
+static ssize_t scull_p_write_urgent(struct scull_pipe *dev, struct file *filp,
+        const char __user *buf, size_t count)
+{
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_p_lane *lane = &dev->lanes[pf->prio - 1];
+    unsigned int head, need = SCULL_P_HDR + ALIGN(count, SCULL_P_HDR);
+    long timeo = scull_p_timeo(pf->sndtimeo);
+
+    if (!count)
+        return 0;   /* an empty message would read as end of file */
+    if (count > SCULL_P_URGENT_MAX)
+        return -EMSGSIZE;
+    if (mutex_lock_interruptible(&dev->wmutex))
+        return -ERESTARTSYS;
+    if (dev->bcast) {
+        mutex_unlock(&dev->wmutex);
+        return -EINVAL;
+    }
+    if (!lane->buf) {
+        /* readers only look at it once head has moved */
+        lane->buf = kmalloc(SCULL_P_LANE_SIZE, GFP_KERNEL);
+        if (!lane->buf) {
+            mutex_unlock(&dev->wmutex);
+            return -ENOMEM;
+        }
+    }
+    while (scull_p_lane_room(lane) < need) {
+        mutex_unlock(&dev->wmutex);
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        timeo = wait_event_interruptible_timeout(dev->outq,
+                scull_p_lane_room(lane) >= need, timeo);
+        if (timeo < 0)
+            return -ERESTARTSYS;
+        if (!timeo)
+            return -ETIMEDOUT;
+        if (mutex_lock_interruptible(&dev->wmutex))
+            return -ERESTARTSYS;
+    }
+    head = lane->head;
+    *(u32 *) (lane->buf + (head & (SCULL_P_LANE_SIZE - 1))) = count;
+    if (scull_p_lane_in(lane, head + SCULL_P_HDR, buf, count)) {
+        mutex_unlock(&dev->wmutex);
+        return -EFAULT;
+    }
+    smp_store_release(&lane->head, head + need);
+    mutex_unlock(&dev->wmutex);
+
+    /* any reader will do, whatever it waits for in the buffer */
+    if (wq_has_sleeper(&dev->inq))
+        wake_up_interruptible_poll(&dev->inq, EPOLLIN | EPOLLRDNORM | EPOLLPRI);
+    if (dev->async_queue)
+        kill_fasync(&dev->async_queue, SIGIO, POLL_PRI);
+    return count;
+}
+
+static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_ops)
+{
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+    unsigned int head, record;
+    size_t done = 0, n;
+    u32 len = count;
+    long timeo = scull_p_timeo(pf->sndtimeo);
+    int result = 0;
+
+    if (pf->prio)
+        return scull_p_write_urgent(dev, filp, buf, count);
+again:
+    if (mutex_lock_interruptible(&dev->wmutex))
+        return -ERESTARTSYS;
+    record = dev->record;
+    if (record && !count) {
+        mutex_unlock(&dev->wmutex);
+        return 0;   /* an empty record would read as end of file */
+    }
+    if (record && count > record) {
+        mutex_unlock(&dev->wmutex);
+        return -EMSGSIZE;
+    }
+
+    if (record) {
+        /* Make sure there's space to write all of the record */
+        result = scull_getwritespace(dev, filp, SCULL_P_HDR + len, &timeo);
+        if (result)
+            return result;  /* scull_getwritespace called mutex_unlock(&dev->wmutex) */
+        if (dev->record != record) {
+            /* the pipe emptied and changed modes while we slept */
+            mutex_unlock(&dev->wmutex);
+            goto again;
+        }
+        /* a record goes in whole, even across the end of the buffer */
+        head = dev->head;
+        scull_p_poke(dev, head, &len, SCULL_P_HDR);
+        if (scull_p_copy_in(dev, head + SCULL_P_HDR, buf, count)) {
+            mutex_unlock(&dev->wmutex);
+            return -EFAULT;
+        }
+        /* publish the data before the reader can see the new head */
+        smp_store_release(&dev->head, head + SCULL_P_HDR + count);
+        scull_p_stamp(dev, head + SCULL_P_HDR + count);
+        scull_p_account(dev);
+        done = count;
+    } else {
+        /*
+         * A byte stream works like a pipe: a write of up to PIPE_BUF
+         * bytes goes in all at once, a bigger one a piece at a time,
+         * and a blocking writer waits until all of it is in, for
+         * room of at least its low watermark each time.
+         */
+        while (done < count) {
+            if (count <= PIPE_BUF)
+                n = count;
+            else if (filp->f_flags & O_NONBLOCK)
+                n = 1;
+            else
+                n = min_t(size_t, count - done, pf->sndlowat);
+            /* a broadcast writer that overruns never waits */
+            if (dev->bcast == SCULL_P_BCAST_OVERRUN)
+                scull_p_make_room(dev, min_t(size_t, count - done, dev->size));
+            result = scull_getwritespace(dev, filp, min_t(size_t, n, dev->size), &timeo);
+            if (result)
+                goto out_unlocked;  /* mutex_unlock was called */
+            if (dev->record) {
+                mutex_unlock(&dev->wmutex);
+                if (!done)
+                    goto again;
+                goto out_unlocked;
+            }
+            head = dev->head;
+            n = min(count - done, (size_t) spacefree(dev));
+            PDEBUG("Going to accept %li bytes at %u from %p\n", (long)n, head, buf + done);
+            if (scull_p_copy_in(dev, head, buf + done, n)) {
+                result = -EFAULT;
+                break;
+            }
+            smp_store_release(&dev->head, head + n);
+            scull_p_stamp(dev, head + n);
+            scull_p_account(dev);
+            done += n;
+            /* let the reader make room for the rest */
+            scull_p_wake_readers(dev);
+            if (filp->f_flags & O_NONBLOCK)
+                break;
+        }
+    }
+    mutex_unlock(&dev->wmutex);
+
+out_unlocked:
+    if (!done)
+        return result;
+
+    /* finally, awake any reader */
+    scull_p_wake_readers(dev);  /* blocked in read() and select() */
+    scull_p_pass(dev, 1);
+
+    /* and signal asynchronous readers, explained late in chapter 5 */
+    if (dev->async_queue)
+        kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+    PDEBUG("\"%s\" did write %li bytes\n", current->comm, (long)done);
+    return done;
+}
+
+/*
+ * Splice support. Pages handed to a pipe are plain pages: whoever ends
+ * up with the last reference frees them.
+ */
+static const struct pipe_buf_operations scull_p_buf_ops = {
+    .can_merge = 0,
+    .confirm = generic_pipe_buf_confirm,
+    .release = generic_pipe_buf_release,
+    .steal = generic_pipe_buf_steal,
+    .get = generic_pipe_buf_get,
+};
+
+/*
+ * Move data from the scullpipe into a pipe. A page of the ring that is
+ * all data is given away as it is, and a fresh page takes its place;
+ * anything else, and anything in a mirrored ring, is copied. Record
+ * mode is not supported.
+ */
+static ssize_t scull_p_splice_read(struct file *filp, loff_t *ppos,
+        struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+    struct pipe_buffer buf = { .ops = &scull_p_buf_ops };
+    unsigned int tail, avail, pg;
+    struct page *fresh;
+    ssize_t done = 0, ret = 0;
+    size_t n;
+
+    if (mutex_lock_interruptible(&dev->rmutex))
+        return -ERESTARTSYS;
+    if (dev->record || dev->bcast) {
+        mutex_unlock(&dev->rmutex);
+        return -EINVAL;
+    }
+    if ((flags & SPLICE_F_NONBLOCK) && !scull_p_avail(dev)) {
+        mutex_unlock(&dev->rmutex);
+        return -EAGAIN;
+    }
+    ret = scull_getdata(dev, filp, 1, 0);
+    if (ret)
+        return ret;     /* scull_getdata called mutex_unlock(&dev->rmutex) */
+
+    tail = dev->tail;
+    avail = scull_p_avail(dev);
+    while (len && avail && pipe->nrbufs < pipe->buffers) {
+        n = min3(len, (size_t) avail, (size_t) (PAGE_SIZE - offset_in_page(tail)));
+        pg = (tail & (dev->size - 1)) >> PAGE_SHIFT;
+        fresh = alloc_page(GFP_KERNEL);
+        if (!fresh) {
+            ret = -ENOMEM;
+            break;
+        }
+        if (n == PAGE_SIZE && !dev->vaddr) {
+            /* gift the page; the ring keeps its reference until the pipe has it */
+            buf.page = dev->pages[pg];
+            get_page(buf.page);
+        } else {
+            buf.page = fresh;
+            memcpy(page_address(fresh), scull_p_addr(dev, tail), n);
+        }
+        buf.offset = 0;
+        buf.len = n;
+        ret = add_to_pipe(pipe, &buf);  /* drops the page on failure */
+        if (ret < 0) {
+            if (buf.page != fresh)
+                put_page(fresh);
+            break;
+        }
+        if (buf.page != fresh) {
+            clear_highpage(fresh);  /* it joins the ring, see scull_p_alloc_pages() */
+            put_page(dev->pages[pg]);
+            dev->pages[pg] = fresh;
+        }
+        tail += n;
+        avail -= n;
+        len -= n;
+        done += n;
+    }
+    /* the new pages are in place before the writer sees the space */
+    smp_store_release(&dev->tail, tail);
+    scull_p_stamp_done(dev, tail);
+    mutex_unlock(&dev->rmutex);
+
+    if (done) {
+        scull_p_wake_writers(dev);
+        scull_p_pass(dev, 0);
+    }
+    return done ? done : ret;
+}
+
+/*
+ * Take one pipe buffer into the ring. A whole page that lands on a page
+ * boundary of the ring is stolen, if the pipe lets us, and replaces the
+ * ring's own page; anything else is copied. A broadcast reader that
+ * overruns may still be copying from the page, and a mirrored ring has
+ * its pages mapped, so then it is copied too.
+ */
+static int scull_p_splice_actor(struct pipe_inode_info *pipe,
+        struct pipe_buffer *buf, struct splice_desc *sd)
+{
+    struct file *filp = sd->u.file;
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+    unsigned int head, pg;
+    long timeo = scull_p_timeo(pf->sndtimeo);
+    struct page *old;
+    char *src;
+    size_t n;
+    int result;
+
+    if (mutex_lock_interruptible(&dev->wmutex))
+        return -ERESTARTSYS;
+    if (dev->record) {
+        mutex_unlock(&dev->wmutex);
+        return -EINVAL;
+    }
+    if ((sd->flags & SPLICE_F_NONBLOCK) && !spacefree(dev)) {
+        mutex_unlock(&dev->wmutex);
+        return -EAGAIN;
+    }
+    if (dev->bcast == SCULL_P_BCAST_OVERRUN)
+        scull_p_make_room(dev, min_t(size_t, sd->len,
+                                     PAGE_SIZE - offset_in_page(dev->head)));
+    result = scull_getwritespace(dev, filp, 1, &timeo);
+    if (result)
+        return result;  /* scull_getwritespace called mutex_unlock(&dev->wmutex) */
+
+    head = dev->head;
+    n = min3((size_t) sd->len, (size_t) spacefree(dev),
+             (size_t) (PAGE_SIZE - offset_in_page(head)));
+    pg = (head & (dev->size - 1)) >> PAGE_SHIFT;
+    if (n == PAGE_SIZE && buf->offset == 0 && !PageHighMem(buf->page)
+            && dev->bcast != SCULL_P_BCAST_OVERRUN && !dev->vaddr
+            && pipe_buf_steal(pipe, buf) == 0) {
+        /* the page is ours now, and comes locked */
+        get_page(buf->page);
+        unlock_page(buf->page);
+        old = dev->pages[pg];
+        dev->pages[pg] = buf->page;
+        put_page(old);
+    } else {
+        src = kmap_atomic(buf->page);
+        memcpy(scull_p_addr(dev, head), src + buf->offset, n);
+        kunmap_atomic(src);
+    }
+    smp_store_release(&dev->head, head + n);
+    scull_p_stamp(dev, head + n);
+    scull_p_account(dev);
+    mutex_unlock(&dev->wmutex);
+
+    scull_p_wake_readers(dev);
+    scull_p_pass(dev, 1);
+    if (dev->async_queue)
+        kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+    return n;
+}
+
+static ssize_t scull_p_splice_write(struct pipe_inode_info *pipe,
+        struct file *filp, loff_t *ppos, size_t len, unsigned int flags)
+{
+    return splice_from_pipe(pipe, filp, ppos, len, flags, scull_p_splice_actor);
+}
+
+/*
+ * Mode changes and resizing shut out everybody: take all three
+ * mutexes, in order.
+ */
+static int scull_p_lock_all(struct scull_pipe *dev)
+{
+    if (mutex_lock_interruptible(&dev->mutex))
+        return -ERESTARTSYS;
+    if (mutex_lock_interruptible(&dev->rmutex)) {
+        mutex_unlock(&dev->mutex);
+        return -ERESTARTSYS;
+    }
+    if (mutex_lock_interruptible(&dev->wmutex)) {
+        mutex_unlock(&dev->rmutex);
+        mutex_unlock(&dev->mutex);
+        return -ERESTARTSYS;
+    }
+    return 0;
+}
+
+static void scull_p_unlock_all(struct scull_pipe *dev)
+{
+    mutex_unlock(&dev->wmutex);
+    mutex_unlock(&dev->rmutex);
+    mutex_unlock(&dev->mutex);
+}
+
+/*
+ * Is there nothing left to read? In broadcast mode, for any reader.
+ * Called with all mutexes held.
+ */
+static int scull_p_empty(struct scull_pipe *dev)
+{
+    struct scull_p_file *pf;
+    int i;
+
+    for (i = 0; i < SCULL_P_LANES - 1; i++)
+        if (dev->lanes[i].head != dev->lanes[i].tail)
+            return 0;
+    if (!dev->bcast)
+        return dev->head == dev->tail;
+    list_for_each_entry(pf, &dev->readers, list)
+        if (pf->cursor != dev->head)
+            return 0;
+    return 1;
+}
+
+/*
+ * Switch between a byte stream and record mode, with "limit" as the
+ * largest record. Only an empty pipe can change modes.
+ */
+static int scull_p_set_record(struct scull_pipe *dev, unsigned long limit)
+{
+    int retval;
+
+    retval = scull_p_lock_all(dev);
+    if (retval)
+        return retval;
+    if (!dev->pages || limit > dev->size - SCULL_P_HDR || dev->bcast)
+        retval = -EINVAL;
+    else if (!scull_p_empty(dev))
+        retval = -EBUSY;
+    else
+        WRITE_ONCE(dev->record, limit);     /* read by poll() without a lock */
+    scull_p_unlock_all(dev);
+    return retval;
+}
+
+/*
+ * Turn broadcast mode on, with one of the policies, or off. As with
+ * record mode, which it doesn't go with, the pipe must be empty; the
+ * readers all start from the current head.
+ */
+static int scull_p_set_bcast(struct scull_pipe *dev, unsigned long policy)
+{
+    struct scull_p_file *pf;
+    int retval;
+
+    if (policy > SCULL_P_BCAST_OVERRUN)
+        return -EINVAL;
+    retval = scull_p_lock_all(dev);
+    if (retval)
+        return retval;
+    if (dev->record || (policy && dev->stamps)) {
+        retval = -EINVAL;
+    } else if (!scull_p_empty(dev)) {
+        retval = -EBUSY;
+    } else {
+        list_for_each_entry(pf, &dev->readers, list)
+            pf->cursor = dev->head;
+        smp_store_release(&dev->tail, dev->head);
+        WRITE_ONCE(dev->bcast, policy);     /* read by poll() without a lock */
+    }
+    scull_p_unlock_all(dev);
+    return retval;
+}
+
+/*
+ * Turn latency stamps on, with an empty histogram, or off. Stamps are
+ * queued and retired under the reader and writer mutexes, so all of
+ * them are taken to swap the queue.
+ */
+static int scull_p_set_stamp(struct scull_pipe *dev, unsigned long on)
+{
+    struct scull_p_stamps *st = NULL, *old;
+    int retval;
+
+    if (on) {
+        st = kzalloc(sizeof(struct scull_p_stamps), GFP_KERNEL);
+        if (!st)
+            return -ENOMEM;
+    }
+    retval = scull_p_lock_all(dev);
+    if (retval) {
+        kfree(st);
+        return retval;
+    }
+    if (on && dev->bcast) {
+        retval = -EINVAL;
+        old = st;
+    } else {
+        old = dev->stamps;
+        dev->stamps = st;
+    }
+    scull_p_unlock_all(dev);
+    kfree(old);
+    return retval;
+}
+
+static int scull_p_get_lat(struct scull_pipe *dev, struct scull_p_lat __user *ul)
+{
+    struct scull_p_lat lat;
+
+    memset(&lat, 0, sizeof(lat));
+    if (mutex_lock_interruptible(&dev->rmutex))
+        return -ERESTARTSYS;
+    if (dev->stamps) {
+        memcpy(lat.hist, dev->stamps->hist, sizeof(lat.hist));
+        lat.dropped = READ_ONCE(dev->stamps->dropped);
+    }
+    mutex_unlock(&dev->rmutex);
+    lat.blocked_ns = atomic64_read(&dev->blocked_ns);
+    lat.blocked = atomic_long_read(&dev->blocked);
+    return copy_to_user(ul, &lat, sizeof(lat)) ? -EFAULT : 0;
+}
+
+/* Bytes this reader lost to overruns since it last asked */
+static long scull_p_skipped(struct scull_pipe *dev, struct scull_p_file *pf)
+{
+    long skipped;
+
+    if (mutex_lock_interruptible(&dev->rmutex))
+        return -ERESTARTSYS;
+    skipped = min_t(unsigned long, pf->skipped, LONG_MAX);
+    pf->skipped = 0;
+    mutex_unlock(&dev->rmutex);
+    return skipped;
+}
+
+/*
+ * Give the device a ring of "arg" bytes, rounded up like scull_p_open()
+ * does, and move the data over. Returns the new size.
+ */
+static long scull_p_resize(struct scull_pipe *dev, unsigned long arg)
+{
+    unsigned int size, oldsize, used, idx, chunk;
+    struct page **pages, **old;
+    char *vaddr;
+    long retval;
+
+    if (arg > 1U << 30)
+        return -EINVAL;     /* head - tail must not overflow */
+    size = roundup_pow_of_two(max_t(unsigned long, arg, PAGE_SIZE));
+    if (size > scull_p_max_size && !capable(CAP_SYS_RESOURCE))
+        return -EPERM;
+    pages = scull_p_get_ring(size);
+    if (!pages)
+        return -ENOMEM;
+    vaddr = scull_p_vmap(pages, size);
+
+    if (scull_p_lock_all(dev)) {
+        scull_p_vunmap(vaddr);
+        scull_p_put_ring(pages, size);
+        return -ERESTARTSYS;
+    }
+    used = dev->head - dev->tail;
+    oldsize = size;
+    if (atomic_read(&dev->mmaps)) {
+        retval = -EBUSY;    /* the mappings would keep the old pages */
+    } else if (used > size) {
+        retval = -EBUSY;
+    } else if (dev->record > size - SCULL_P_HDR) {
+        retval = -EINVAL;   /* the largest record would not fit */
+    } else {
+        /* same indices in both rings, so a chunk never crosses a page in either */
+        for (idx = dev->tail; idx != dev->head; idx += chunk) {
+            chunk = min_t(unsigned int, dev->head - idx,
+                          PAGE_SIZE - offset_in_page(idx));
+            memcpy(scull_p_ring_addr(pages, size, idx), scull_p_addr(dev, idx), chunk);
+        }
+        old = dev->pages;
+        oldsize = dev->size;
+        dev->pages = pages;
+        swap(dev->vaddr, vaddr);
+        WRITE_ONCE(dev->size, size);        /* read by poll() without a lock */
+        dev->setsize = size;
+        dev->peak = used;
+        pages = old;
+        retval = size;
+    }
+    scull_p_unlock_all(dev);
+    scull_p_vunmap(vaddr);
+    scull_p_put_ring(pages, oldsize);
+
+    /* a bigger ring may have room for someone */
+    if (retval > 0)
+        scull_p_wake_writers(dev);
+    return retval;
+}
+
+static int scull_p_stat(struct scull_pipe *dev, struct scull_p_stat __user *ust)
+{
+    struct scull_p_stat st;
+
+    if (mutex_lock_interruptible(&dev->wmutex))
+        return -ERESTARTSYS;
+    st.size = dev->size;
+    st.avail = dev->head - READ_ONCE(dev->tail);
+    st.peak = dev->peak;
+    st.full = dev->full;
+    mutex_unlock(&dev->wmutex);
+    return copy_to_user(ust, &st, sizeof(st)) ? -EFAULT : 0;
+}
+
+/*
+ * Where the data is, for a reader of the mmap()ed mirror, and freeing
+ * what it has read. Like a read() these need rmutex, and, as for
+ * splice, a byte stream without broadcast.
+ */
+static int scull_p_get_mmap(struct file *filp, struct scull_p_mmap __user *um)
+{
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+    struct scull_p_mmap mm;
+
+    if (!(filp->f_mode & FMODE_READ))
+        return -EBADF;
+    if (mutex_lock_interruptible(&dev->rmutex))
+        return -ERESTARTSYS;
+    if (dev->record || dev->bcast) {
+        mutex_unlock(&dev->rmutex);
+        return -EINVAL;
+    }
+    mm.size = dev->size;
+    mm.head = smp_load_acquire(&dev->head);
+    mm.tail = dev->tail;
+    mutex_unlock(&dev->rmutex);
+    return copy_to_user(um, &mm, sizeof(mm)) ? -EFAULT : 0;
+}
+
+static int scull_p_consume(struct file *filp, unsigned long n)
+{
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+
+    if (!(filp->f_mode & FMODE_READ))
+        return -EBADF;
+    if (mutex_lock_interruptible(&dev->rmutex))
+        return -ERESTARTSYS;
+    if (dev->record || dev->bcast || n > scull_p_avail(dev)) {
+        mutex_unlock(&dev->rmutex);
+        return -EINVAL;
+    }
+    smp_store_release(&dev->tail, dev->tail + n);
+    scull_p_stamp_done(dev, dev->tail);
+    mutex_unlock(&dev->rmutex);
+
+    scull_p_wake_writers(dev);
+    scull_p_pass(dev, 0);
+    return 0;
+}
+
+/*
+ * The ioctl() implementation for the pipe devices
+ */
+static long scull_p_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+
+    if (_IOC_TYPE(cmd) != SCULL_IOC_MAGIC) return -ENOTTY;
+    if (_IOC_NR(cmd) > SCULL_IOC_MAXNR) return -ENOTTY;
+
+    switch(cmd) {
+        case SCULL_P_IOCTSIZE:
+            if (!capable(CAP_SYS_ADMIN))
+                return -EPERM;
+            scull_p_buffer = arg;
+            break;
+
+        case SCULL_P_IOCQSIZE:
+            return scull_p_buffer;
+
+        case SCULL_P_IOCTRECORD:
+            return scull_p_set_record(dev, arg);
+
+        case SCULL_P_IOCQRECORD:
+            return dev->record;
+
+        case SCULL_P_IOCRECVMMSG:
+            return scull_p_recvmmsg(filp, (struct scull_p_mmsg __user *)arg);
+
+        case SCULL_P_IOCTPIPESZ:
+            return scull_p_resize(dev, arg);
+
+        case SCULL_P_IOCQPIPESZ:
+            return dev->size;
+
+        case SCULL_P_IOCGSTAT:
+            return scull_p_stat(dev, (struct scull_p_stat __user *)arg);
+
+        case SCULL_P_IOCTRCVLOWAT:
+            if (arg > INT_MAX)
+                return -EINVAL;
+            pf->rcvlowat = arg ? arg : 1;
+            break;
+
+        case SCULL_P_IOCQRCVLOWAT:
+            return pf->rcvlowat;
+
+        case SCULL_P_IOCTSNDLOWAT:
+            if (arg > INT_MAX)
+                return -EINVAL;
+            pf->sndlowat = arg ? arg : 1;
+            break;
+
+        case SCULL_P_IOCQSNDLOWAT:
+            return pf->sndlowat;
+
+        case SCULL_P_IOCTBCAST:
+            return scull_p_set_bcast(dev, arg);
+
+        case SCULL_P_IOCQBCAST:
+            return dev->bcast;
+
+        case SCULL_P_IOCQSKIP:
+            return scull_p_skipped(dev, pf);
+
+        case SCULL_P_IOCTPRIO:
+            if (arg >= SCULL_P_LANES)
+                return -EINVAL;
+            pf->prio = arg;
+            break;
+
+        case SCULL_P_IOCQPRIO:
+            return pf->prio;
+
+        case SCULL_P_IOCTBUSYPOLL:
+            if (arg > USEC_PER_SEC)
+                return -EINVAL;
+            pf->busy_poll = arg;
+            pf->busy_ns = (u64) arg * NSEC_PER_USEC;
+            break;
+
+        case SCULL_P_IOCQBUSYPOLL:
+            return pf->busy_poll;
+
+        case SCULL_P_IOCTRCVTIMEO:
+            if (arg > INT_MAX)
+                return -EINVAL;
+            pf->rcvtimeo = arg;
+            break;
+
+        case SCULL_P_IOCQRCVTIMEO:
+            return pf->rcvtimeo;
+
+        case SCULL_P_IOCTSNDTIMEO:
+            if (arg > INT_MAX)
+                return -EINVAL;
+            pf->sndtimeo = arg;
+            break;
+
+        case SCULL_P_IOCQSNDTIMEO:
+            return pf->sndtimeo;
+
+        case SCULL_P_IOCTPERSIST:
+            if (mutex_lock_interruptible(&dev->mutex))
+                return -ERESTARTSYS;
+            dev->persist = !!arg;   /* looked at by the last release */
+            mutex_unlock(&dev->mutex);
+            break;
+
+        case SCULL_P_IOCQPERSIST:
+            return dev->persist;
+
+        case SCULL_P_IOCGMMAP:
+            return scull_p_get_mmap(filp, (struct scull_p_mmap __user *)arg);
+
+        case SCULL_P_IOCTCONSUME:
+            return scull_p_consume(filp, arg);
+
+        case SCULL_P_IOCTSTAMP:
+            return scull_p_set_stamp(dev, arg);
+
+        case SCULL_P_IOCQSTAMP:
+            return dev->stamps != NULL;
+
+        case SCULL_P_IOCGLAT:
+            return scull_p_get_lat(dev, (struct scull_p_lat __user *)arg);
+
+        default:
+            return -ENOTTY;
+    }
+    return 0;
+}
+
+
+static unsigned int scull_p_poll(struct file *filp, poll_table *wait)
+{
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+    unsigned int mask = 0, rneed, wneed, size, record;
+
+    /*
+     * The buffer is circular; it is considered full
+     * if "head" is a whole buffer ahead of "tail" and empty if the 
+     * two are equal.
+     */
+    /*
+     * 缓冲区是环形的；也就是说，如果head比tail多出整个缓冲区，则表明
+     * 缓冲区已满，而如果它们两个相等，则表明是空的。
+     */
+    /*
+     * No lock: head and tail are published with release stores, and
+     * the thresholds make sure a change after the check wakes us. The
+     * size and the mode may change under us, which only makes this
+     * answer stale, as any poll() answer can be.
+     */
+    /* with EPOLLEXCLUSIVE, epoll queues these exclusively, like read() */
+    poll_wait(filp, &dev->inq, wait);
+    poll_wait(filp, &dev->outq, wait);
+    size = READ_ONCE(dev->size);
+    record = READ_ONCE(dev->record);
+    /* readable at the low watermark; in record mode, at any record */
+    rneed = record ? 1 : min(pf->rcvlowat, size);
+    if (scull_p_readable(dev, pf, rneed, 0))
+        mask |= POLLIN | POLLRDNORM;
+    /* after scull_p_readable(), whose barrier orders it with our wait */
+    if (scull_p_urgent(dev))
+        mask |= POLLPRI | POLLIN | POLLRDNORM;
+    if (pf->prio) {
+        /* urgent writers need room for the biggest message in their lane */
+        if (scull_p_lane_room(&dev->lanes[pf->prio - 1])
+                >= SCULL_P_HDR + SCULL_P_URGENT_MAX)
+            mask |= POLLOUT | POLLWRNORM;
+        return mask;
+    }
+    /* in record mode, writable means a record of any size fits */
+    wneed = record ? SCULL_P_HDR + record : 1;
+    wneed = min(max(wneed, pf->sndlowat), size);
+    if (scull_p_writable(dev, wneed))
+        mask |= POLLOUT | POLLWRNORM;
+    return mask;
+}
+
+/*
+ * mmap() of the mirror, read-only: the pages are put in place at once,
+ * and stay for the life of the mapping. Mappings are counted, so that
+ * the ring can't be resized under them.
+ */
+static void scull_p_vma_open(struct vm_area_struct *vma)
+{
+    struct scull_pipe *dev = vma->vm_private_data;
+
+    atomic_inc(&dev->mmaps);
+}
+
+static void scull_p_vma_close(struct vm_area_struct *vma)
+{
+    struct scull_pipe *dev = vma->vm_private_data;
+
+    atomic_dec(&dev->mmaps);
+}
+
+static const struct vm_operations_struct scull_p_vm_ops = {
+    .open =     scull_p_vma_open,
+    .close =    scull_p_vma_close,
+};
+
+static int scull_p_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+    unsigned long i, npages = vma_pages(vma);
+    int err = 0;
+
+    if (!(filp->f_mode & FMODE_READ))
+        return -EACCES;
+    if (vma->vm_pgoff || (vma->vm_flags & VM_WRITE))
+        return -EINVAL;
+    /* dev->mutex keeps resize away; rmutex could deadlock on mmap_sem */
+    if (mutex_lock_interruptible(&dev->mutex))
+        return -ERESTARTSYS;
+    if (!dev->vaddr) {
+        err = -ENODEV;      /* too small to be mirrored */
+        goto out;
+    }
+    if (npages != 2 * (dev->size >> PAGE_SHIFT)) {
+        err = -EINVAL;
+        goto out;
+    }
+    vma->vm_flags &= ~VM_MAYWRITE;
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+    for (i = 0; i < npages; i++) {
+        err = vm_insert_page(vma, vma->vm_start + (i << PAGE_SHIFT),
+                             dev->pages[i & ((dev->size >> PAGE_SHIFT) - 1)]);
+        if (err)
+            goto out;
+    }
+    vma->vm_ops = &scull_p_vm_ops;
+    vma->vm_private_data = dev;
+    scull_p_vma_open(vma);
+
+out:
+    mutex_unlock(&dev->mutex);
+    return err;
+}
+
+#ifdef SCULL_DEBUG
+static int scull_read_p_mem(struct seq_file *s, void *v)
+{
+    struct scull_pipe *p;
+    int i, j;
+
+    seq_printf(s, "Default buffer size %i, max %u\n", scull_p_buffer, scull_p_max_size);
+    mutex_lock(&scull_p_pool_lock);
+    seq_printf(s, "Pool: %i free rings, %lu hits, %lu misses\n",
+               scull_p_nfree, scull_p_pool_hits, scull_p_pool_misses);
+    mutex_unlock(&scull_p_pool_lock);
+    for (i = 0; i < scull_p_nr_devs; i++) {
+        p = &scull_p_devices[i];
+        if (mutex_lock_interruptible(&p->mutex))
+            return -ERESTARTSYS;
+        seq_printf(s, "\nDevice %i: %p\n", i, p);
+        seq_printf(s, "   Buffer: %u bytes%s%s%s, record %u, %i mmaps\n", p->size,
+                   p->pages ? "" : " (not allocated)",
+                   p->vaddr ? " (mirrored)" : "",
+                   p->persist ? " (persistent)" : "", p->record,
+                   atomic_read(&p->mmaps));
+        seq_printf(s, "   head %u   tail %u   avail %u   peak %u   full %lu\n",
+                   READ_ONCE(p->head), READ_ONCE(p->tail),
+                   READ_ONCE(p->head) - READ_ONCE(p->tail), p->peak, p->full);
+        for (j = 0; j < SCULL_P_LANES - 1; j++)
+            seq_printf(s, "   urgent %i: %u bytes\n", j + 1,
+                       READ_ONCE(p->lanes[j].head) - READ_ONCE(p->lanes[j].tail));
+        seq_printf(s, "   writers blocked %li times, %lld ns\n",
+                   atomic_long_read(&p->blocked), (long long) atomic64_read(&p->blocked_ns));
+        if (p->stamps) {
+            /* the stamps are only freed with all the mutexes held */
+            seq_printf(s, "   latency (log2 ns: writes), %lu unstamped:",
+                       p->stamps->dropped);
+            for (j = 0; j < SCULL_P_LAT_BUCKETS; j++)
+                if (p->stamps->hist[j])
+                    seq_printf(s, " %i:%lu", j, p->stamps->hist[j]);
+            seq_printf(s, "\n");
+        }
+        seq_printf(s, "   readers %i   writers %i\n", p->nreaders, p->nwriters);
+        mutex_unlock(&p->mutex);
+    }
+    return 0;
+}
+
+static int scull_p_proc_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, scull_read_p_mem, NULL);
+}
+
+static struct file_operations scull_p_proc_ops = {
+    .owner     = THIS_MODULE,
+    .open      = scull_p_proc_open,
+    .read      = seq_read,
+    .llseek    = seq_lseek,
+    .release   = single_release
+};
+#endif
 
 /*
  * The file operations for the pipe device
@@ -265,7 +2101,10 @@ struct file_operations scull_pipe_fops = {
     .read =     scull_p_read,
     .write =    scull_p_write,
     .poll =     scull_p_poll,
-//    .unlocked_ioctl =   scull_ioctl,
+    .unlocked_ioctl =   scull_p_ioctl,
+    .splice_read =  scull_p_splice_read,
+    .splice_write = scull_p_splice_write,
+    .mmap =     scull_p_mmap,
     .open =     scull_p_open,
     .release =  scull_p_release,
 //    .fasync =   scull_p_fasync,
@@ -308,12 +2147,17 @@ int scull_p_init(dev_t firstdev)
     for (i = 0; i < scull_p_nr_devs; i++) {
         init_waitqueue_head(&(scull_p_devices[i].inq));
         init_waitqueue_head(&(scull_p_devices[i].outq));
+        INIT_LIST_HEAD(&scull_p_devices[i].readers);
+        scull_p_devices[i].rwant = scull_p_devices[i].wwant = UINT_MAX;
+        mutex_init(&scull_p_devices[i].rmutex);
+        mutex_init(&scull_p_devices[i].wmutex);
         mutex_init(&scull_p_devices[i].mutex);
         scull_p_setup_cdev(scull_p_devices + i, i);
     }
+    scull_p_pool_fill();
 
 #ifdef SCULL_DEBUG
-//    proc_create("scullpipe", 0, NULL, scull_read_p_mem);
+    proc_create("scullpipe", 0, NULL, &scull_p_proc_ops);
 #endif 
     return scull_p_nr_devs;
 }
@@ -335,8 +2179,13 @@ void scull_p_cleanup(void)
     
     for (i = 0; i < scull_p_nr_devs; i++) {
         cdev_del(&scull_p_devices[i].cdev);
-        kfree(scull_p_devices[i].buffer);
+        /* persistent devices still hold theirs */
+        scull_p_vunmap(scull_p_devices[i].vaddr);
+        scull_p_free_pages(scull_p_devices[i].pages, scull_p_devices[i].size);
+        scull_p_free_lanes(scull_p_devices + i);
+        kfree(scull_p_devices[i].stamps);
     }
+    scull_p_pool_drain();
     kfree(scull_p_devices);
     unregister_chrdev_region(scull_p_devno, scull_p_nr_devs);
     scull_p_devices = NULL; /* pedantic */
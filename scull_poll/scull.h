@@ -63,6 +63,31 @@
 #define SCULL_QSET 1000
 #endif
 
+/*
+ * Devices hinted for sequential or write-once access use bigger quanta,
+ * and sequential readers prefetch up to SCULL_PREFETCH_MAX bytes of the
+ * next quantum.
+ */
+#ifndef SCULL_QUANTUM_SEQ
+#define SCULL_QUANTUM_SEQ (32 * 1024)
+#endif
+
+#ifndef SCULL_PREFETCH_MAX
+#define SCULL_PREFETCH_MAX 4096
+#endif
+
+/*
+ * Extents, used for big appends in extent mode, start at
+ * SCULL_EXTENT_MIN bytes and double up to SCULL_EXTENT_MAX.
+ */
+#ifndef SCULL_EXTENT_MIN
+#define SCULL_EXTENT_MIN (64 * 1024)
+#endif
+
+#ifndef SCULL_EXTENT_MAX
+#define SCULL_EXTENT_MAX (4 * 1024 * 1024)
+#endif
+
 /*
  * Representation of scull quantum sets.
  */
@@ -77,54 +102,27 @@
      int qset;                  /* the current array size */
      unsigned long size;        /* amount of data stored here */
      unsigned int access_key;   /* used by sculluid and scullpriv */
+     int ring_quanta;           /* ring capacity in quanta, 0 if unbounded */
+     int ring_flags;            /* SCULL_RING_* behaviour of a ring device */
+     int kv_mode;               /* records are only stored through ioctl */
+     struct scull_kv *kv;       /* key index, kept once allocated */
+     int sealed;                /* read-only for good, read without lock */
+     int numa_policy;           /* SCULL_NUMA_*: where new quanta go */
+     int numa_node;             /* node for SCULL_NUMA_NODE */
+     int numa_next;             /* last node used by SCULL_NUMA_INTERLEAVE */
+     int extent_mode;           /* big appends go to extents */
+     struct rb_root_cached extents; /* interval tree of extents */
+     size_t extent_next;        /* size of the next extent */
+     unsigned long allocs;      /* allocations since the last trim */
+     struct work_struct compact_work; /* background compaction */
+     int exports;               /* dma-bufs out on the device's pages */
+     int hint;                  /* SCULL_HINT_*: expected access pattern */
      struct mutex mutex;        /* mutual exclusion semaphore */
      struct cdev cdev;          /* Char device structure */
  };
 
 
-/*
- * Ioctl definition
- */
-
-/* Use 'k' as magic number */
-#define SCULL_IOC_MAGIC 'k'
-
-/* Please use a different 8-bit number in your code */
-
-#define SCULL_IOCRESET  _IO(SCULL_IOC_MAGIC, 0)
-
-
-/*
- * S means "Set" through a ptr,
- * T means "Tell" directly with the argument value 
- * G means "Get": reply by setting through a pointer 
- * Q means "Query": response is on the return value 
- * X means "eXchange": switch G and S atomically 
- * H means "sHift": switch T and Q atomically
- */
-#define SCULL_IOCSQUANTUM    _IOW(SCULL_IOC_MAGIC, 1, int)
-#define SCULL_IOCSQSET      _IOW(SCULL_IOC_MAGIC, 2, int)
-#define SCULL_IOCTQUANTUM   _IO(SCULL_IOC_MAGIC, 3)
-#define SCULL_IOCTQSET      _IO(SCULL_IOC_MAGIC, 4)
-#define SCULL_IOCGQUANTUM   _IOR(SCULL_IOC_MAGIC, 5, int)
-#define SCULL_IOCGQSET      _IOR(SCULL_IOC_MAGIC, 6, int)
-#define SCULL_IOCQQUANTUM   _IO(SCULL_IOC_MAGIC, 7)
-#define SCULL_IOCQQSET      _IO(SCULL_IOC_MAGIC, 8)
-#define SCULL_IOCXQUANTUM   _IOWR(SCULL_IOC_MAGIC, 9, int)
-#define SCULL_IOCXQSET      _IOWR(SCULL_IOC_MAGIC, 10, int)
-#define SCULL_IOCHQUANTUM   _IO(SCULL_IOC_MAGIC, 11)
-#define SCULL_IOCHQSET      _IO(SCULL_IOC_MAGIC, 12)
-
-/* 
- * The other entities only have "Tell" and "Query", because they're 
- * not printed in the book, and there's no need to have all six.
- * (The previous stuff was only there to show different ways to do it.)
- */
- #define SCULL_P_IOCTSIZE _IO(SCULL_IOC_MAGIC, 13)
- #define SCULL_P_IOCQSIZE _IO(SCULL_IOC_MAGIC, 14)
-/* ... more to come */
-
-#define SCULL_IOC_MAXNR 14
+#include "scull_ioctl.h"     /* ioctl definitions, shared with user space */
 
 /*
  * Prototypes for shared functions
@@ -132,4 +130,39 @@
 int     scull_p_init(dev_t dev);
 void    scull_p_cleanup(void);
 
+extern struct file_operations scull_fops;
+
+int     scull_trim(struct scull_dev *dev);
+void    scull_free_qsets(struct scull_qset *dptr, int qset);
+char    *scull_get_quantum(struct scull_dev *dev, loff_t pos);
+char    *scull_find_quantum(struct scull_dev *dev, loff_t pos);
+char    *scull_locate(struct scull_dev *dev, loff_t pos, size_t *len, int create);
+void    **scull_slot(struct scull_dev *dev, loff_t pos, int create);
+void    scull_prune(struct scull_dev *dev);
+int     scull_alloc_node(struct scull_dev *dev);
+
+int     scull_kv_enable(struct scull_dev *dev, int on);
+long    scull_kv_ioctl(struct scull_dev *dev, unsigned int cmd, unsigned long arg);
+void    scull_kv_clear(struct scull_dev *dev);
+unsigned long scull_kv_nkeys(struct scull_dev *dev);
+
+void    scull_extent_grow(struct scull_dev *dev, loff_t pos, size_t count);
+char    *scull_extent_add(struct scull_dev *dev, loff_t pos, size_t size);
+unsigned long scull_extent_slack(struct scull_dev *dev);
+char    *scull_extent_locate(struct scull_dev *dev, loff_t pos, size_t *len);
+void    scull_extent_stat(struct scull_dev *dev, struct scull_stat *st);
+void    scull_extent_numa_stat(struct scull_dev *dev, struct scull_numa_stat *st);
+void    scull_extent_truncate(struct scull_dev *dev, loff_t len);
+void    scull_extent_trim(struct scull_dev *dev);
+void    scull_kv_cleanup(struct scull_dev *dev);
+
+long    scull_export_ioctl(struct file *filp, unsigned long arg);
+
+void    scull_compact_init(struct scull_dev *dev);
+int     scull_compact(struct scull_dev *dev, int wait);
+void    scull_frag(struct scull_dev *dev, struct scull_frag *fr);
+void    scull_compact_start(void);
+void    scull_compact_stop(void);
+void    scull_compact_cancel(struct scull_dev *dev);
+
 #endif /* SCULL_H */
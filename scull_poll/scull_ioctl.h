@@ -0,0 +1,401 @@
+/*************************************************************************
+	> File Name: scull_ioctl.h
+	> Author: 
+	> Mail: 
+	> Created Time: 2026年10月19日 星期一 09时12分20秒
+ ************************************************************************/
+
+/*
+ * The user-visible interface of the scull devices: ioctl numbers and
+ * the structures they take. scull.h includes it, and so do programs
+ * that drive the devices, such as example/scull_bench.c.
+ */
+
+#ifndef _SCULL_IOCTL_H
+#define _SCULL_IOCTL_H
+
+#include <linux/ioctl.h>    /* needed for the _IOW etc stuff used later */
+
+/*
+ * Ioctl definition
+ */
+
+/* Use 'k' as magic number */
+#define SCULL_IOC_MAGIC 'k'
+
+/* Please use a different 8-bit number in your code */
+
+#define SCULL_IOCRESET  _IO(SCULL_IOC_MAGIC, 0)
+
+
+/*
+ * S means "Set" through a ptr,
+ * T means "Tell" directly with the argument value 
+ * G means "Get": reply by setting through a pointer 
+ * Q means "Query": response is on the return value 
+ * X means "eXchange": switch G and S atomically 
+ * H means "sHift": switch T and Q atomically
+ */
+#define SCULL_IOCSQUANTUM    _IOW(SCULL_IOC_MAGIC, 1, int)
+#define SCULL_IOCSQSET      _IOW(SCULL_IOC_MAGIC, 2, int)
+#define SCULL_IOCTQUANTUM   _IO(SCULL_IOC_MAGIC, 3)
+#define SCULL_IOCTQSET      _IO(SCULL_IOC_MAGIC, 4)
+#define SCULL_IOCGQUANTUM   _IOR(SCULL_IOC_MAGIC, 5, int)
+#define SCULL_IOCGQSET      _IOR(SCULL_IOC_MAGIC, 6, int)
+#define SCULL_IOCQQUANTUM   _IO(SCULL_IOC_MAGIC, 7)
+#define SCULL_IOCQQSET      _IO(SCULL_IOC_MAGIC, 8)
+#define SCULL_IOCXQUANTUM   _IOWR(SCULL_IOC_MAGIC, 9, int)
+#define SCULL_IOCXQSET      _IOWR(SCULL_IOC_MAGIC, 10, int)
+#define SCULL_IOCHQUANTUM   _IO(SCULL_IOC_MAGIC, 11)
+#define SCULL_IOCHQSET      _IO(SCULL_IOC_MAGIC, 12)
+
+/* 
+ * The other entities only have "Tell" and "Query", because they're 
+ * not printed in the book, and there's no need to have all six.
+ * (The previous stuff was only there to show different ways to do it.)
+ */
+ #define SCULL_P_IOCTSIZE _IO(SCULL_IOC_MAGIC, 13)
+ #define SCULL_P_IOCQSIZE _IO(SCULL_IOC_MAGIC, 14)
+
+/*
+ * Ring ("flight recorder") mode: the device keeps only the last
+ * "quanta" quanta written to it. Writes always append, and once the
+ * ring is full the oldest quantum is overwritten in place. Reading
+ * or seeking to data that has been overwritten fails with -ESPIPE,
+ * unless SCULL_RING_SKIP asks to skip forward to the oldest data.
+ * Setting the ring empties the device; quanta == 0 turns it off.
+ */
+struct scull_ring {
+    int quanta;
+    int flags;
+};
+
+#define SCULL_RING_SKIP     0x1
+
+#define SCULL_IOCSRING      _IOW(SCULL_IOC_MAGIC, 15, struct scull_ring)
+#define SCULL_IOCGRING      _IOR(SCULL_IOC_MAGIC, 16, struct scull_ring)
+
+/*
+ * Key-value mode: each PUT appends a record (header, key, value) to
+ * the device, and an in-kernel hash index finds it again. A record
+ * never crosses a quantum, so a value is at most a quantum minus the
+ * key and an 8 byte header. GET and MULTI-GET run without the device
+ * mutex. Overwritten and deleted records are reclaimed by compacting
+ * the store once they outweigh the live ones, which changes the offsets
+ * records sit at. Turning the mode on or off with SCULL_IOCTKV empties
+ * the device; plain write() fails with -EPERM while it is on.
+ */
+#define SCULL_KV_KEY_MAX    256
+
+struct scull_kv_op {
+    void *key;
+    unsigned int klen;
+    unsigned int vlen;          /* GET: buffer size in, value size out */
+    void *val;
+    int status;                 /* MULTI-GET: 0, -ENOENT or -EMSGSIZE */
+};
+
+struct scull_kv_mget {
+    struct scull_kv_op *ops;
+    unsigned int nops;
+};
+
+#define SCULL_IOCTKV        _IO(SCULL_IOC_MAGIC, 17)
+#define SCULL_IOCKVPUT      _IOW(SCULL_IOC_MAGIC, 18, struct scull_kv_op)
+#define SCULL_IOCKVGET      _IOWR(SCULL_IOC_MAGIC, 19, struct scull_kv_op)
+#define SCULL_IOCKVDEL      _IOW(SCULL_IOC_MAGIC, 20, struct scull_kv_op)
+#define SCULL_IOCKVMGET     _IOW(SCULL_IOC_MAGIC, 21, struct scull_kv_mget)
+
+/*
+ * Sealing makes a device read-only for good, like F_SEAL_WRITE on a
+ * memfd: writes, trims and mode changes fail with -EPERM, and reads no
+ * longer take the device mutex. As with F_SEAL_WRITE and writable
+ * mappings, sealing fails with -EBUSY while dma-bufs are out.
+ */
+#define SCULL_IOCSEAL       _IO(SCULL_IOC_MAGIC, 22)
+#define SCULL_IOCQSEAL      _IO(SCULL_IOC_MAGIC, 23)
+
+/*
+ * Copy a range from another scull device, entirely in the kernel. The
+ * ioctl goes to the destination; the layout follows FICLONERANGE. With
+ * SCULL_COPY_MOVE, quanta that line up on both sides (same quantum
+ * size, quantum-aligned offsets) are moved instead of copied, leaving
+ * holes behind in the source. The number of bytes copied comes back
+ * in "copied"; overlapping ranges on one device are -EINVAL.
+ */
+struct scull_copy_range {
+    long long src_fd;
+    unsigned long long src_offset;
+    unsigned long long src_length;
+    unsigned long long dest_offset;
+    unsigned int flags;
+    unsigned long long copied;  /* out */
+};
+
+#define SCULL_COPY_MOVE     0x1
+
+#define SCULL_IOCCOPY       _IOWR(SCULL_IOC_MAGIC, 24, struct scull_copy_range)
+
+/*
+ * NUMA placement of new quanta: on the writer's node (the default),
+ * round-robin over all nodes with memory, or on one given node. The
+ * stats count the quanta and the extent pages a device holds on each
+ * node.
+ */
+#define SCULL_NUMA_LOCAL        0
+#define SCULL_NUMA_INTERLEAVE   1
+#define SCULL_NUMA_NODE         2
+
+#define SCULL_NUMA_NODES        8   /* nodes reported by the stats */
+
+struct scull_numa {
+    int policy;
+    int node;
+};
+
+struct scull_numa_stat {
+    unsigned long quanta[SCULL_NUMA_NODES];
+    unsigned long extent_pages[SCULL_NUMA_NODES];
+};
+
+#define SCULL_IOCSNUMA      _IOW(SCULL_IOC_MAGIC, 25, struct scull_numa)
+#define SCULL_IOCGNUMA      _IOR(SCULL_IOC_MAGIC, 26, struct scull_numa)
+#define SCULL_IOCGNUMASTAT  _IOR(SCULL_IOC_MAGIC, 27, struct scull_numa_stat)
+
+/*
+ * Extent mode: an append of at least a quantum, or one continuing a
+ * stream that filled the previous extent, gets a variable-size extent
+ * instead of quanta. Other writes keep using quanta. The stats count
+ * what a device holds and how many allocations it took since the last
+ * trim.
+ */
+struct scull_stat {
+    unsigned long size;
+    unsigned long quanta;
+    unsigned long qsets;
+    unsigned long extents;
+    unsigned long extent_bytes;
+    unsigned long allocs;
+};
+
+#define SCULL_IOCTEXTENT    _IO(SCULL_IOC_MAGIC, 28)
+#define SCULL_IOCGSTAT      _IOR(SCULL_IOC_MAGIC, 29, struct scull_stat)
+
+/*
+ * Compaction moves runs of whole quanta into extents and frees the
+ * pointer arrays and qsets left empty. It runs in the background; a
+ * non-zero argument waits for it to finish. Ring, kv and sealed
+ * devices are not compacted. The fragmentation metrics show how much
+ * it has to do, and how well it did.
+ */
+struct scull_frag {
+    unsigned long quanta;
+    unsigned long qsets;
+    unsigned long empty_qsets;  /* qsets without a single quantum */
+    unsigned long empty_slots;  /* unused pointers in the qset arrays */
+    unsigned long slack_bytes;  /* memory held that holds no data */
+    unsigned int occupancy;     /* percentage of pointers in use */
+};
+
+#define SCULL_IOCTCOMPACT   _IO(SCULL_IOC_MAGIC, 30)
+#define SCULL_IOCGFRAG      _IOR(SCULL_IOC_MAGIC, 31, struct scull_frag)
+
+/*
+ * Truncate the device to the length given as argument, like
+ * ftruncate(): only what lies beyond the new end is freed, and growing
+ * the device leaves a hole that reads as zeros. Ring and kv devices
+ * can't be truncated, and a length past what the quantum list can
+ * address is -EINVAL.
+ */
+#define SCULL_IOCTTRUNC     _IO(SCULL_IOC_MAGIC, 32)
+
+/*
+ * Export [offset, offset + length) as a dma-buf; its fd comes back in
+ * "fd". The buffer is the device's own pages, so the range must be page
+ * aligned, within the device, and backed by extents or by quanta that
+ * are a multiple of the page size. "flags" takes O_RDWR and O_CLOEXEC;
+ * a writable buffer needs a file opened for writing.
+ * Until the last buffer is released, anything that would free the
+ * device's memory fails with -EBUSY.
+ */
+struct scull_export {
+    unsigned long long offset;
+    unsigned long long length;
+    unsigned int flags;
+    int fd;
+};
+
+#define SCULL_IOCEXPORT     _IOWR(SCULL_IOC_MAGIC, 33, struct scull_export)
+
+/*
+ * Access pattern hints, in the spirit of posix_fadvise(). SEQUENTIAL
+ * and WRITEONCE get big quanta, RANDOM page-sized ones; the quantum
+ * size changes at once on an empty device, at the next trim otherwise.
+ * All but NORMAL and RANDOM allocate the next qset ahead of the writer,
+ * and SEQUENTIAL and WILLNEED readers prefetch the next quantum.
+ */
+#define SCULL_HINT_NORMAL       0
+#define SCULL_HINT_SEQUENTIAL   1
+#define SCULL_HINT_RANDOM       2
+#define SCULL_HINT_WRITEONCE    3
+#define SCULL_HINT_WILLNEED     4
+
+#define SCULL_IOCTHINT      _IO(SCULL_IOC_MAGIC, 34)
+#define SCULL_IOCQHINT      _IO(SCULL_IOC_MAGIC, 35)
+
+/*
+ * Record mode for scullpipe: the argument is the largest record, 0
+ * goes back to a byte stream. Each write() is one record, stored whole
+ * or not at all (-EMSGSIZE if too big; an empty write stores nothing),
+ * and each read() returns one record, dropping what doesn't fit.
+ * RECVMMSG returns a batch of records, back to back in "buf", with
+ * their lengths in "lens".
+ */
+struct scull_p_mmsg {
+    void *buf;
+    unsigned long len;          /* size of buf */
+    unsigned int *lens;
+    unsigned int nrecs;         /* in: size of lens, out: records read */
+};
+
+#define SCULL_P_IOCTRECORD  _IO(SCULL_IOC_MAGIC, 36)
+#define SCULL_P_IOCQRECORD  _IO(SCULL_IOC_MAGIC, 37)
+#define SCULL_P_IOCRECVMMSG _IOWR(SCULL_IOC_MAGIC, 38, struct scull_p_mmsg)
+
+/*
+ * Per-device buffer size for scullpipe, like F_SETPIPE_SZ: the size is
+ * rounded up to a power of two of at least a page, and the new size is
+ * returned. Data in the buffer is kept; shrinking below it fails with
+ * -EBUSY. Sizes above the scull_p_max_size parameter need
+ * CAP_SYS_RESOURCE. The size sticks to the device until changed again.
+ * GSTAT tells how full the buffer gets, to help pick a size.
+ */
+struct scull_p_stat {
+    unsigned int size;          /* of the buffer */
+    unsigned int avail;         /* bytes in it now */
+    unsigned int peak;          /* most bytes it held since the last resize */
+    unsigned long full;         /* times a writer found it too full */
+};
+
+#define SCULL_P_IOCTPIPESZ  _IO(SCULL_IOC_MAGIC, 39)
+#define SCULL_P_IOCQPIPESZ  _IO(SCULL_IOC_MAGIC, 40)
+#define SCULL_P_IOCGSTAT    _IOR(SCULL_IOC_MAGIC, 41, struct scull_p_stat)
+
+/*
+ * Low watermarks of an open scullpipe, like SO_RCVLOWAT and
+ * SO_SNDLOWAT: a blocking read() waits for that many bytes (or for its
+ * whole count, if smaller), a blocking write() is woken once that much
+ * room is free, and poll() reports POLLIN and POLLOUT at the same
+ * marks. The default, 1, is the plain pipe behaviour; 0 means 1.
+ */
+#define SCULL_P_IOCTRCVLOWAT _IO(SCULL_IOC_MAGIC, 42)
+#define SCULL_P_IOCQRCVLOWAT _IO(SCULL_IOC_MAGIC, 43)
+#define SCULL_P_IOCTSNDLOWAT _IO(SCULL_IOC_MAGIC, 44)
+#define SCULL_P_IOCQSNDLOWAT _IO(SCULL_IOC_MAGIC, 45)
+
+/*
+ * Broadcast mode for scullpipe: every reader gets every byte, from the
+ * point it opened the device on. With SCULL_P_BCAST_BLOCK the slowest
+ * reader holds the writers back; with SCULL_P_BCAST_OVERRUN writers
+ * never wait, and a reader that falls a whole buffer behind loses the
+ * oldest data: its next read() fails with -EOVERFLOW and QSKIP returns
+ * (and clears) the number of bytes it skipped. Byte streams only, and
+ * only an empty pipe can change modes; 0 turns broadcast off.
+ */
+#define SCULL_P_BCAST_BLOCK     1
+#define SCULL_P_BCAST_OVERRUN   2
+
+#define SCULL_P_IOCTBCAST   _IO(SCULL_IOC_MAGIC, 46)
+#define SCULL_P_IOCQBCAST   _IO(SCULL_IOC_MAGIC, 47)
+#define SCULL_P_IOCQSKIP    _IO(SCULL_IOC_MAGIC, 48)
+
+/*
+ * Priority of what an open scullpipe writes. At 0, the default, writes
+ * go to the buffer as usual. Above it they are urgent messages, kept in
+ * a small lane of their own per priority, next to the buffer: read()
+ * returns one urgent message at a time, the highest priority first,
+ * before any buffered data, and poll() reports POLLPRI while there is
+ * one. A message is at most SCULL_P_URGENT_MAX bytes; broadcast pipes
+ * take none.
+ */
+#define SCULL_P_LANES       4       /* priorities 0 to 3 */
+#define SCULL_P_URGENT_MAX  1024
+
+#define SCULL_P_IOCTPRIO    _IO(SCULL_IOC_MAGIC, 49)
+#define SCULL_P_IOCQPRIO    _IO(SCULL_IOC_MAGIC, 50)
+
+/*
+ * Busy polling for scullpipe readers, like SO_BUSY_POLL: a blocking
+ * read() that finds too little data spins for up to that many
+ * microseconds before it goes to sleep. The spin adapts, between an
+ * eighth of the limit and all of it, to how soon data has been coming.
+ * Files start with the scull_p_busy_poll parameter; 0 turns it off.
+ */
+#define SCULL_P_IOCTBUSYPOLL _IO(SCULL_IOC_MAGIC, 51)
+#define SCULL_P_IOCQBUSYPOLL _IO(SCULL_IOC_MAGIC, 52)
+
+/*
+ * Receive and send timeouts of an open scullpipe, in milliseconds, like
+ * SO_RCVTIMEO and SO_SNDTIMEO: a blocking read() or write() that has
+ * waited that long gives up with -ETIMEDOUT, or returns what it got
+ * done by then. 0, the default, waits forever.
+ */
+#define SCULL_P_IOCTRCVTIMEO _IO(SCULL_IOC_MAGIC, 53)
+#define SCULL_P_IOCQRCVTIMEO _IO(SCULL_IOC_MAGIC, 54)
+#define SCULL_P_IOCTSNDTIMEO _IO(SCULL_IOC_MAGIC, 55)
+#define SCULL_P_IOCQSNDTIMEO _IO(SCULL_IOC_MAGIC, 56)
+
+/*
+ * Persistent scullpipe: the buffer, and what is in it, is kept when the
+ * last file is closed, for whoever opens the device next. Off by
+ * default, when the buffer goes back to the module's pool of free
+ * buffers (see the scull_p_pool parameter).
+ */
+#define SCULL_P_IOCTPERSIST _IO(SCULL_IOC_MAGIC, 57)
+#define SCULL_P_IOCQPERSIST _IO(SCULL_IOC_MAGIC, 58)
+
+/*
+ * Zero-copy reading of a scullpipe. A buffer of at least the
+ * scull_p_mirror_min parameter is mapped twice, back to back, so that
+ * data that wraps around its end is still contiguous. A reader may
+ * mmap() that double mapping, read-only, at offset 0 and twice the
+ * buffer size. GMMAP tells where the data is: it starts at offset
+ * (tail & (size - 1)) and is head - tail bytes long. CONSUME then
+ * frees that many bytes, as a read() of them would. A mapped buffer
+ * can't be resized. Byte streams only, without broadcast.
+ */
+struct scull_p_mmap {
+    unsigned int size;          /* of the buffer; the mapping is twice that */
+    unsigned int head;          /* bytes ever written */
+    unsigned int tail;          /* bytes ever read */
+};
+
+#define SCULL_P_IOCGMMAP    _IOR(SCULL_IOC_MAGIC, 59, struct scull_p_mmap)
+#define SCULL_P_IOCTCONSUME _IO(SCULL_IOC_MAGIC, 60)
+
+/*
+ * Latency of a scullpipe. With TSTAMP on, every write is stamped with
+ * the time its data went in, and once a reader has taken the last of
+ * it, the time it spent in the buffer is counted in a histogram by its
+ * log2 in nanoseconds: hist[i] counts writes that waited 2^i to
+ * 2^(i+1) ns, the last bucket anything longer. Turning it on again
+ * clears the histogram. Not with broadcast. GLAT also tells how long
+ * writers slept waiting for room, which is counted all the time.
+ */
+#define SCULL_P_LAT_BUCKETS 32
+
+struct scull_p_lat {
+    unsigned long hist[SCULL_P_LAT_BUCKETS];
+    unsigned long dropped;      /* writes too many to stamp, not counted */
+    unsigned long long blocked_ns;  /* writers asleep for room, in all */
+    unsigned long blocked;      /* times they went to sleep */
+};
+
+#define SCULL_P_IOCTSTAMP   _IO(SCULL_IOC_MAGIC, 61)
+#define SCULL_P_IOCQSTAMP   _IO(SCULL_IOC_MAGIC, 62)
+#define SCULL_P_IOCGLAT     _IOR(SCULL_IOC_MAGIC, 63, struct scull_p_lat)
+/* ... more to come */
+
+#define SCULL_IOC_MAXNR 63
+
+#endif /* _SCULL_IOCTL_H */